@@ -0,0 +1,23 @@
+#!/bin/bash
+# Compares the threaded dispatch interpreter (fml) with the switch
+# based one (fml_switch) on the sudoku integration test.
+# usage: benchmarks/dispatch.sh [runs]
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BUILD="$ROOT/_bench_build"
+PROGRAM="$ROOT/integration_tests/sudoku.fml.bc"
+RUNS=${1:-3}
+
+cmake -S "$ROOT" -B "$BUILD" -DCMAKE_BUILD_TYPE=Release 1>/dev/null
+cmake --build "$BUILD" --target fml fml_switch 1>/dev/null
+
+for binary in fml fml_switch; do
+    for run in $(seq 1 "$RUNS"); do
+        start=$(date +%s%N)
+        "$BUILD/$binary" execute "$PROGRAM" 1>/dev/null
+        end=$(date +%s%N)
+        echo "$binary run $run: $(( (end - start) / 1000000 )) ms"
+    done
+done
@@ -0,0 +1,101 @@
+/**
+ * Measures how the parallel marking scales with the number of threads.
+ * Builds nested arrays of instances, each instance holds an array and the
+ * next instance of the list, and marks the graph with 1 to N threads.
+ *
+ * usage: gc_mark_bench [max threads] [instances] [runs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "include/vm.h"
+#include "include/memory.h"
+#include "include/objects.h"
+#include "include/buddy_alloc.h"
+#include "include/gc_parallel.h"
+
+#define HEAP_SIZE (1024UL * 1024 * 1024)
+#define LIST_LENGTH 1000
+
+static double now_ms(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+}
+
+static value_t build_graph(size_t instances, vm_t* vm) {
+    obj_class_t* class = build_obj_class(vm);
+    value_t class_val = OBJ_VAL(class);
+    class->fields[class->size++] = build_obj_string(4, "data", hash_string("data"), vm);
+    class->fields[class->size++] = build_obj_string(4, "next", hash_string("next"), vm);
+
+    value_t init = NULL_VAL;
+    size_t lists = (instances + LIST_LENGTH - 1) / LIST_LENGTH;
+    obj_array_t* root = build_obj_array(lists, &init, vm);
+    for (size_t i = 0; i < lists; ++i) {
+        value_t next = NULL_VAL;
+        for (size_t j = 0; j < LIST_LENGTH; ++j) {
+            value_t number = INTEGER_VAL(j);
+            value_t fields[2] = { OBJ_ARRAY_VAL(4, &number, vm), next };
+            next = OBJ_INSTANCE_VAL(&class_val, fields, &init, vm);
+        }
+        root->values[i] = next;
+    }
+    return OBJ_VAL(root);
+}
+
+static int compare_times(const void* x, const void* y) {
+    double a = *(const double*)x;
+    double b = *(const double*)y;
+    return (a > b) - (a < b);
+}
+
+int main(int argc, const char* argv[]) {
+    size_t max_threads = argc > 1 ? (size_t)atol(argv[1]) : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t instances = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+    size_t runs = argc > 3 ? (size_t)atol(argv[3]) : 5;
+    if (max_threads == 0 || instances == 0 || runs == 0) {
+        fprintf(stderr, "usage: gc_mark_bench [max threads] [instances] [runs]\n");
+        exit(2);
+    }
+
+    void* heap = malloc(HEAP_SIZE);
+    if (heap == NULL) {
+        fprintf(stderr, "Failed to allocate memory from the OS.\n");
+        exit(11);
+    }
+    heap_init(heap, HEAP_SIZE, NULL);
+    vm_t vm;
+    init_vm(&vm);
+    // Everything is reachable, nothing to collect while building
+    vm.gc_on = false;
+    value_t root = build_graph(instances, &vm);
+
+    reserve_mark_bitmap(&vm.mark_bits);
+    double* times = malloc(sizeof(double) * runs);
+    double single = 0;
+    printf("threads, median ms, speedup\n");
+    for (size_t threads = 1; threads <= max_threads; ++threads) {
+        mark_pool_t* pool = create_mark_pool(threads);
+        for (size_t run = 0; run < runs; ++run) {
+            clear_mark_bitmap(&vm.mark_bits);
+            obj_t* gray = AS_OBJ(root);
+            set_mark(&vm.mark_bits, gray);
+            double start = now_ms();
+            parallel_mark(pool, &vm.mark_bits, &gray, 1);
+            times[run] = now_ms() - start;
+        }
+        free_mark_pool(pool);
+        qsort(times, runs, sizeof(double), compare_times);
+        double median = times[runs / 2];
+        if (threads == 1) {
+            single = median;
+        }
+        printf("%zu, %.2f, %.2f\n", threads, median, single / median);
+    }
+
+    free(times);
+    free_vm(&vm);
+    free(heap);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdlib.h>
+
+/**
+ * Allocation functions used by containers, so the owner decides where the
+ * memory lives (GC heap, arena, system memory...).
+ */
+typedef struct {
+    /// Returns zeroed memory of given size or NULL.
+    void* (*alloc)(size_t size, void* ctx);
+    /// Releases memory returned by alloc, size is the one it was allocated with.
+    void (*free)(void* ptr, size_t size, void* ctx);
+    void* ctx;
+} allocator_t;
+
+/// Allocator using system calloc and free.
+allocator_t system_allocator(void);
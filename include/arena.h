@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "include/allocator.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    _Alignas(16) uint8_t data[];
+} arena_chunk_t;
+
+/**
+ * Region allocator for memory owned by the vm itself. Allocations are only
+ * released all at once by free_arena.
+ */
+typedef struct {
+    arena_chunk_t* chunks;
+    /// Total bytes handed out by the arena.
+    size_t allocated;
+} arena_t;
+
+void init_arena(arena_t* arena);
+
+void free_arena(arena_t* arena);
+
+/// Returns zeroed memory aligned to 16 bytes.
+void* arena_alloc(arena_t* arena, size_t size);
+
+/// Allocator backed by the arena, free is a no-op.
+allocator_t arena_allocator(arena_t* arena);
@@ -1,10 +1,84 @@
+#pragma once
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+/// Allocations start at least a granule apart, it is the smallest size class.
+#define HEAP_GRANULE_SHIFT 4
+#define HEAP_GRANULE (1UL << HEAP_GRANULE_SHIFT)
+/// Allocations up to this size are served from the size class slabs.
+#define HEAP_SLAB_MAX 128
+#define HEAP_SIZE_CLASSES 5
+
+/// Size class of the allocation of at most HEAP_SLAB_MAX bytes.
+static inline size_t heap_size_class(size_t size) {
+    static const uint8_t classes[HEAP_SLAB_MAX / HEAP_GRANULE + 1] = {0, 0, 1, 2, 3, 4, 4, 4, 4};
+    return classes[(size + HEAP_GRANULE - 1) >> HEAP_GRANULE_SHIFT];
+}
+
+/// Size of the slots of the size class.
+static inline size_t heap_class_size(size_t cls) {
+    static const size_t sizes[HEAP_SIZE_CLASSES] = {16, 32, 48, 64, 128};
+    return sizes[cls];
+}
+
+/// Occupancy of one size class.
+typedef struct {
+    // Size of the slots
+    size_t size;
+    // Buddy blocks carved into slots
+    size_t runs;
+    size_t used_slots;
+    size_t total_slots;
+} heap_class_stats_t;
+
+/// Reserves address space for the heap, the memory is committed by the OS when it is touched.
+/// Heap initialized with the reserved memory gives the pages of big free blocks back to the OS.
+/// @param huge_pages Asks for transparent huge pages backing the heap.
+/// @return NULL if the address space couldn't be reserved.
+void* heap_reserve(size_t size, bool huge_pages);
 void heap_init(void* mem_pool, size_t mem_size, const char* log);
 void *heap_alloc(size_t size);
 void heap_log(char action);
 bool heap_free(void *blk);
 size_t heap_done();
+/// Number of bytes of the heap which are not taken by allocated blocks.
+size_t heap_available();
+/// Number of bytes of the heap taken by allocated blocks.
+size_t heap_used();
+/// Reserves the slots of a run of the size class which were never allocated, so that the
+/// caller can bump allocate them from [start, end). Reserved slots count as allocated.
+/// @return false if there is no memory for a new run, or if the class has freed slots
+/// which should be allocated first.
+bool heap_reserve_slots(size_t cls, uint8_t** start, uint8_t** end);
+/// Gives the reserved slots [start, end) which were not bump allocated back to their run.
+void heap_release_slots(uint8_t* start, uint8_t* end);
+/// Fills the occupancy of the size classes, in increasing order of the slot size.
+void heap_class_stats(heap_class_stats_t stats[HEAP_SIZE_CLASSES]);
+/// Start of the heap memory.
+void* heap_start();
+/// Size of the heap in bytes.
+size_t heap_capacity();
 void* heap_realloc(void* blk, size_t new_size);
 void* heap_calloc(size_t cnt, size_t size);
+/// Computes where the allocated blocks are moved by heap_compact, the blocks are slid
+/// towards the start of the heap. Nothing can be allocated or freed until heap_compact.
+void heap_plan_compaction();
+/// Address the block gets by the planned compaction.
+void* heap_forward(void* blk);
+/// Moves the blocks to the planned addresses, the free memory is merged into the biggest blocks.
+void heap_compact();
+/// Gives the pages of the free blocks written since they were freed back to the OS.
+/// Frees only record what was written, the collector calls this after sweeping,
+/// while the heap isn't shared with the sweeper thread.
+void heap_release_pages();
+/// Sets the heap usage (in the terms of heap_used) at which the next GC should start.
+void heap_set_gc_trigger(size_t bytes);
+/// The GC trigger, 0 if it wasn't set since the heap initialization.
+size_t heap_gc_trigger();
+/// True if the heap usage reached the GC trigger.
+bool heap_gc_due();
+/// Makes the heap functions safe to call from multiple threads. It can be
+/// changed only when no other thread is using the heap.
+void heap_set_shared(bool shared);
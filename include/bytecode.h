@@ -23,8 +23,88 @@ typedef enum {
     OP_SET_FIELD = 0x06,
     OP_CALL_METHOD = 0x07,
     OP_DROP = 0x10,
+
+    // Specialized method calls on builtin types. These are not part of the
+    // bytecode format, they are created when pre-decoding OP_CALL_METHOD and
+    // fall back to it if the operands are not of the expected type.
+    OP_ADD_INT = 0x20,
+    OP_SUB_INT = 0x21,
+    OP_MUL_INT = 0x22,
+    OP_DIV_INT = 0x23,
+    OP_MOD_INT = 0x24,
+    OP_LT_INT = 0x25,
+    OP_LE_INT = 0x26,
+    OP_GT_INT = 0x27,
+    OP_GE_INT = 0x28,
+    OP_EQ_INT = 0x29,
+    OP_NEQ_INT = 0x2A,
+    OP_ARRAY_GET = 0x2B,
+    OP_ARRAY_SET = 0x2C,
 } opcode_t;
 
+/// Operators of builtin types, resolved from method names when loading.
+typedef enum {
+    BUILTIN_NONE,
+    BUILTIN_ADD,
+    BUILTIN_SUB,
+    BUILTIN_MUL,
+    BUILTIN_DIV,
+    BUILTIN_MOD,
+    BUILTIN_LE,
+    BUILTIN_GE,
+    BUILTIN_LT,
+    BUILTIN_GT,
+    BUILTIN_EQ,
+    BUILTIN_NEQ,
+    BUILTIN_OR,
+    BUILTIN_AND,
+    BUILTIN_GET,
+    BUILTIN_SET,
+} builtin_t;
+
+struct method_cache;
+struct field_cache;
+
+/// Alignment of the pre-decoded instructions array, one cache line.
+#define CODE_ALIGNMENT 64
+
+/**
+ * Pre-decoded instruction. The bytecode is translated into an array of
+ * these at load time, so the interpreter doesn't have to decode operands
+ * or index the constant pool.
+ */
+typedef struct instruction {
+    /// Address of the instruction handler in the interpreter, resolved when interpretation starts.
+    const void* handler;
+    uint8_t opcode;
+    /// Number of arguments for calls and print.
+    uint8_t arg_cnt;
+    /// Builtin operator (builtin_t) called by method call.
+    uint8_t builtin;
+    /// Offset of the instruction in the original bytecode, used for debugging.
+    uint32_t offset;
+    union {
+        /// OP_LITERAL and OP_PRINT value, OP_OBJECT class.
+        value_t value;
+        struct {
+            /// Name of the global, field, method or function.
+            obj_string_t* name;
+            union {
+                /// Inline cache of the call site, only for OP_CALL_METHOD.
+                struct method_cache* cache;
+                /// Inline cache of the field access, only for OP_GET_FIELD and OP_SET_FIELD.
+                struct field_cache* field_cache;
+                /// Slot of the global variable or function.
+                uint32_t slot;
+            };
+        };
+        /// Local variable index.
+        uint16_t index;
+        /// Jump destination.
+        struct instruction* target;
+    };
+} instruction_t;
+
 typedef struct {
     uint8_t* bytecode;
     size_t size;
@@ -32,6 +112,13 @@ typedef struct {
     size_t offset;
     constant_pool_t pool;
     global_indexes_t globals;
+    /// Pre-decoded bytecode, the interpreter executes this.
+    instruction_t* code;
+    size_t code_size;
+    /// Inline caches of all method call sites.
+    struct method_cache* caches;
+    /// Inline caches of all field accesses.
+    struct field_cache* field_caches;
 } chunk_t;
 
 void init_chunk(chunk_t* chunk);
@@ -28,6 +28,24 @@ typedef enum {
 
 typedef struct obj obj_t;
 
+/**
+ * If __COMPACT_VALUES__ is defined, values are 8 bytes big instead of 16.
+ * The type is stored in the lowest three bits, which are always zero for
+ * object pointers since objects are 8 bytes aligned. Integers and booleans
+ * are stored in the upper 32 bits.
+ *
+ * Values have to be accessed only through the macros below, which are the
+ * same for both representations.
+ */
+#ifdef __COMPACT_VALUES__
+typedef struct {
+    uint64_t bits;
+} value_t;
+
+_Static_assert(sizeof(value_t) == 8, "Compact value has to be 8 bytes.");
+
+#define VALUE_TAG_MASK 7UL
+#else
 typedef struct {
     constant_type_t type;
     union {
@@ -36,11 +54,15 @@ typedef struct {
         struct obj* obj;
     };
 } value_t;
+#endif // __COMPACT_VALUES__
 
 typedef struct obj {
     obj_type_t type;
-    // Used for GC
-    bool marked;
+    // Nursery object which was already promoted, next points to its copy
+    // in the old generation. Mark bits of the GC are kept in the vm bitmap.
+    bool forwarded;
+    // Old object which is in the remembered set of the generational GC.
+    bool remembered;
     struct obj *next;
 } obj_t;
 
@@ -59,8 +81,12 @@ typedef struct {
     uint8_t args;
     // Number of local variables.
     uint16_t locals;
+    // Maximum depth of the operand stack, not counting the locals.
+    uint32_t max_stack;
     // Byte where the function starts.
     uint32_t entry_point;
+    // Index of the first pre-decoded instruction of the function.
+    uint32_t code_entry;
     // Length of the function in bytes.
     size_t length;
 } obj_function_t;
@@ -97,38 +123,62 @@ void free_globals(global_indexes_t* globals);
 
 obj_string_t* build_obj_string(size_t len, const char* ptr, uint32_t hash, vm_t* vm);
 
+/// Returns the interned string with given contents, the string is created
+/// if it wasn't interned yet. Interned strings can be compared by pointers.
+obj_string_t* intern_obj_string(size_t len, const char* ptr, uint32_t hash, vm_t* vm);
+
 /// Allocates function object on heap and returns pointer to it, fields of function are zero initialized
 /// with exception of object, which is initialized correctly.
 obj_function_t* build_obj_fun(vm_t* vm);
 
 obj_slot_t* build_obj_slot(uint16_t index, vm_t* vm);
 
-obj_array_t* build_obj_array(size_t size, value_t init, vm_t* vm);
+/// Allocates array filled with the initial value. The value is read after the
+/// allocation, so it can point to the stack where the GC can update it.
+obj_array_t* build_obj_array(size_t size, const value_t* init, vm_t* vm);
 
 obj_native_fun_t* build_obj_native(native_fun_t fun, vm_t* vm);
 
 // 'Constructor' functions for values.
+#ifdef __COMPACT_VALUES__
+#define INTEGER_VAL(value) ((value_t){((uint64_t)(uint32_t)(value) << 32) | TYPE_INTEGER})
+#define BOOL_VAL(value)    ((value_t){((uint64_t)!!(value) << 32) | TYPE_BOOLEAN})
+#define NULL_VAL           ((value_t){TYPE_NULL})
+#define OBJ_VAL(value)     ((value_t){(uint64_t)(uintptr_t)(obj_t*)(value) | TYPE_OBJECT})
+#else
 #define INTEGER_VAL(value) ((value_t){TYPE_INTEGER, {.num = (value)}})
 #define BOOL_VAL(value)    ((value_t){TYPE_BOOLEAN, {.b = (value)}})
 #define NULL_VAL           ((value_t){TYPE_NULL, {.num = 0}})
 #define OBJ_VAL(value)     ((value_t){TYPE_OBJECT, {.obj = (obj_t*)(value)}})
+#endif // __COMPACT_VALUES__
 
 /// Creates an object value containing string.
 /// @param len - Length of the string to copy.
 /// @param source - const char* pointer to the string to copy from.
 #define OBJ_STRING_VAL(len, source, hash, vm) (OBJ_VAL((build_obj_string((len), (source), (hash), (vm)))))
+#define OBJ_INTERNED_STRING_VAL(len, source, hash, vm) (OBJ_VAL((intern_obj_string((len), (source), (hash), (vm)))))
 #define OBJ_FUN_VAL(vm) (OBJ_VAL((build_obj_fun(vm))))
 #define OBJ_SLOT_VAL(index, vm) OBJ_VAL(build_obj_slot(index, vm))
 #define OBJ_ARRAY_VAL(size, init, vm) OBJ_VAL(build_obj_array((size), (init), (vm)))
 
-#define IS_NUMBER(value) ((value).type == TYPE_INTEGER)
-#define IS_BOOL(value) ((value).type == TYPE_BOOLEAN)
-#define IS_NULL(value) ((value).type == TYPE_NULL)
-#define IS_OBJ(value) ((value).type == TYPE_OBJECT)
+#ifdef __COMPACT_VALUES__
+#define VALUE_TYPE(value) ((constant_type_t)((value).bits & VALUE_TAG_MASK))
+
+#define AS_NUMBER(value) ((int32_t)((value).bits >> 32))
+#define AS_BOOL(value) ((bool)((value).bits >> 32))
+#define AS_OBJ(value) ((obj_t*)(uintptr_t)((value).bits & ~VALUE_TAG_MASK))
+#else
+#define VALUE_TYPE(value) ((value).type)
 
 #define AS_NUMBER(value) ((value).num)
 #define AS_BOOL(value) ((value).b)
 #define AS_OBJ(value) ((value).obj)
+#endif // __COMPACT_VALUES__
+
+#define IS_NUMBER(value) (VALUE_TYPE(value) == TYPE_INTEGER)
+#define IS_BOOL(value) (VALUE_TYPE(value) == TYPE_BOOLEAN)
+#define IS_NULL(value) (VALUE_TYPE(value) == TYPE_NULL)
+#define IS_OBJ(value) (VALUE_TYPE(value) == TYPE_OBJECT)
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include "include/constant.h"
+#include "include/mark_bitmap.h"
+
+/**
+ * Pool of threads marking the heap in parallel. Each worker owns a Chase-Lev
+ * deque of gray objects, it pushes and pops on the bottom end of its own deque
+ * and steals from the top end of the other ones when it runs out of work.
+ * Objects are claimed by atomically setting their bit in the mark bitmap, so each object
+ * is scanned exactly once.
+ */
+typedef struct mark_pool mark_pool_t;
+
+/// Starts threads - 1 worker threads, the thread calling parallel_mark is the last worker.
+mark_pool_t* create_mark_pool(size_t threads);
+/// Stops and joins the worker threads.
+void free_mark_pool(mark_pool_t* pool);
+/// Marks everything reachable from the gray objects, which have to be marked already.
+/// Returns after the whole graph is marked, the heap must not be mutated meanwhile.
+void parallel_mark(mark_pool_t* pool, mark_bitmap_t* marks, obj_t** gray, size_t gray_cnt);
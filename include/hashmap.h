@@ -5,30 +5,47 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "include/allocator.h"
 #include "include/memory.h"
 #include "include/constant.h"
 
 #define HASH_MAP_LOAD_BALANCE 0.8
+/// Capacity of the map is always power of two.
+#define HASH_MAP_INIT_CAPACITY 16
 
 typedef struct {
     obj_string_t* key;
     value_t value;
 } entry_t;
 
+/**
+ * Open addressing hash map with Robin Hood hashing. Deleting moves the rest of the
+ * cluster back instead of leaving tombstones, so probe lengths don't degrade with
+ * many inserts and deletes. Empty entries have NULL key.
+ */
 typedef struct {
     size_t count;
     size_t capacity;
     entry_t* entries;
+    /// Where the entries are allocated.
+    allocator_t allocator;
 } hash_map_t;
 
-#define IS_GRAVE(node) ((node)->key == NULL && IS_BOOL((node)->value) && AS_BOOL((node)->value))
-
-void init_hash_map(hash_map_t* hm);
+/// Initializes empty map, the entries will be allocated with given allocator.
+void init_hash_map(hash_map_t* hm, allocator_t allocator);
 
 void free_hash_map(hash_map_t* hm);
 
-/// djb2 hash function, taken from http://www.cse.yorku.ca/~oz/hash.html.
-unsigned long hash_string(const char *str);
+/// Hash of null terminated string, same as hash_bytes(str, strlen(str)).
+uint32_t hash_string(const char *str);
+
+/**
+ * Hash of first 'length' characters of the string. Reads the string
+ * by whole words and folds the result into the 32 bits kept in
+ * obj_string_t, so that the lower bits (used for indexing into the
+ * hashmap) are well distributed.
+ */
+uint32_t hash_bytes(const char *str, size_t length);
 
 /**
  * Inserts value into hashmap under given key. Needs vm because of GC
@@ -40,3 +57,10 @@ bool hash_map_fetch(hash_map_t* hm, obj_string_t* key, value_t* value);
 bool hash_map_delete(hash_map_t* hm, obj_string_t* key);
 
 bool hash_map_update(hash_map_t* hm, obj_string_t* key, value_t new_val);
+
+/**
+ * Finds key with given contents, unlike the other functions keys are compared
+ * by their contents and not by pointers. Used for interning strings.
+ * @return The key or NULL if there is no such key.
+ */
+obj_string_t* hash_map_find_string(hash_map_t* hm, const char* chars, size_t length, uint32_t hash);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "include/constant.h"
+#include "include/buddy_alloc.h"
+
+/**
+ * Mark bits of the heap objects, kept aside from the objects. There is one bit
+ * for each granule of the heap, objects start at least a granule apart so each
+ * has its own bit. Marking doesn't write into the objects and all the marks are cleared
+ * at once at the end of the collection.
+ */
+typedef struct {
+    uint64_t* words;
+    size_t count;
+    uintptr_t base;
+} mark_bitmap_t;
+
+/// Initializes empty bitmap, the memory is allocated by reserve_mark_bitmap.
+void init_mark_bitmap(mark_bitmap_t* bitmap);
+/// Makes the bitmap cover the current heap, has to be called before the marking.
+void reserve_mark_bitmap(mark_bitmap_t* bitmap);
+void free_mark_bitmap(mark_bitmap_t* bitmap);
+/// Unmarks all the objects.
+void clear_mark_bitmap(mark_bitmap_t* bitmap);
+
+static inline size_t mark_index(const mark_bitmap_t* bitmap, const obj_t* obj) {
+    return ((uintptr_t)obj - bitmap->base) >> HEAP_GRANULE_SHIFT;
+}
+
+static inline bool is_marked(const mark_bitmap_t* bitmap, const obj_t* obj) {
+    size_t index = mark_index(bitmap, obj);
+    return (bitmap->words[index / 64] >> (index % 64)) & 1;
+}
+
+/// Marks the object.
+/// @return true if the object wasn't marked before.
+static inline bool set_mark(mark_bitmap_t* bitmap, const obj_t* obj) {
+    size_t index = mark_index(bitmap, obj);
+    uint64_t bit = 1UL << (index % 64);
+    uint64_t* word = &bitmap->words[index / 64];
+    if (*word & bit) {
+        return false;
+    }
+    *word |= bit;
+    return true;
+}
+
+/// Same as set_mark, but can be called by multiple threads. Only one of the threads
+/// marking the same object gets true.
+static inline bool set_mark_atomic(mark_bitmap_t* bitmap, const obj_t* obj) {
+    size_t index = mark_index(bitmap, obj);
+    uint64_t bit = 1UL << (index % 64);
+    uint64_t* word = &bitmap->words[index / 64];
+    // The plain load skips the atomic operation for the already marked objects
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+        return false;
+    }
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
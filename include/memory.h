@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdio.h>
 #include "include/constant.h"
+#include "include/allocator.h"
 
 typedef struct vm vm_t;
 
@@ -33,10 +35,30 @@ typedef struct {
 # define fallthrough                    do {} while (0)  /* fallthrough */
 #endif
 
+/// Allocates memory for new object, its 'forwarded', 'remembered' and 'next' fields
+/// are initialized. In generational mode the object may be allocated in the nursery.
+obj_t* alloc_obj_with_gc(size_t size, vm_t* vm);
 void* alloc_with_gc(size_t size, vm_t* vm);
 void* realloc_with_gc(void* ptr, size_t size, vm_t* vm);
 void* calloc_with_gc(size_t size, size_t cnt, vm_t* vm);
 
+/// Allocator for memory owned by fml objects, it lives on the GC heap.
+allocator_t gc_allocator(vm_t* vm);
+
 /* ============= GC INTERNALS =============== */
 
+typedef void (*child_visitor_t)(obj_t* child, void* ctx);
+
+/**
+ * Calls the visitor with every object referenced by the object. The only place
+ * which knows the references of each object kind, both the serial and the
+ * parallel marking enumerate the children with it.
+ */
+void for_each_child(obj_t* obj, child_visitor_t visitor, void* ctx);
+
+/// Collects the whole heap.
 void run_gc(vm_t* vm);
+/// Finishes the running GC cycle and releases the GC data structures.
+void free_gc(vm_t* vm);
+/// Prints number of collections and the GC pause times.
+void print_gc_stats(FILE* stream, vm_t* vm);
@@ -16,7 +16,8 @@ typedef struct {
     obj_t obj;
     value_t extends;
     obj_class_t* class;
-    hash_map_t fields;
+    /// Values of the fields, in the order of class fields.
+    value_t fields[];
 } obj_instance_t;
 
 #define OBJ_CLASS_VAL(vm) (OBJ_VAL(build_obj_class(vm)))
@@ -29,4 +30,10 @@ obj_class_t* build_obj_class(vm_t* vm);
 #define AS_INSTANCE(value) (((obj_instance_t*)AS_OBJ(value)))
 
 #define OBJ_INSTANCE_VAL(class, fields, extends, vm) (OBJ_VAL(build_obj_instance((class), (fields), (extends), (vm))))
-obj_instance_t* build_obj_instance(obj_class_t* class, hash_map_t fields, value_t extends, vm_t* vm);
+/// Allocates instance of the class, the fields values are copied from 'fields',
+/// which has to contain class->size values. The values (class included) are read after
+/// the allocation, so they can point to the stack or instructions where the GC can update them.
+obj_instance_t* build_obj_instance(const value_t* class, const value_t* fields, const value_t* extends, vm_t* vm);
+
+/// Releases the object and memory owned by it.
+void free_object(obj_t* obj);
@@ -1,11 +1,43 @@
 #pragma once
 
+#include <pthread.h>
+#include "include/arena.h"
 #include "include/bytecode.h"
 #include "include/hashmap.h"
+#include "include/objects.h"
+#include "include/mark_bitmap.h"
 
 #define MAX_FUN_ARGS 256
-#define MAX_LOCALS 256
 #define FRAMES_LIMIT 1024
+#define METHOD_CACHE_SIZE 4
+// Longest parent chain (including the receiver) a method cache entry can describe
+#define METHOD_CACHE_DEPTH 4
+#define FIELD_CACHE_SIZE 4
+// Default size of the value stack in number of values
+#define DEFAULT_STACK_SIZE (1024 * 1024)
+#define DEFAULT_NURSERY_SIZE (8 * 1024 * 1024)
+// Default maximum duration of one incremental GC slice in microseconds
+#define DEFAULT_GC_PAUSE_BUDGET 1000
+
+typedef enum {
+    // Collects the whole heap when the allocation fails.
+    GC_MARK_SWEEP,
+    // New objects are allocated in the nursery, survivors of minor
+    // collections are promoted to the buddy heap.
+    GC_GENERATIONAL,
+    // Marking and sweeping are interleaved with the allocations
+    // in short slices.
+    GC_INCREMENTAL,
+    // Like mark-sweep, then the live objects are slid to the start
+    // of the heap, so the free memory doesn't get fragmented.
+    GC_MARK_COMPACT,
+} gc_mode_t;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} gc_phase_t;
 
 typedef enum {
     INTERPRET_OK,
@@ -13,18 +45,53 @@ typedef enum {
 } interpret_result_t;
 
 typedef struct {
-    value_t locals_vector[MAX_LOCALS];
-    uint8_t* ip_backup;
+    // Index of the first local variable of the frame in the operand stack.
+    // Frame has exactly args + locals variables of the called function,
+    // the arguments are the values the caller pushed on the stack.
+    size_t locals_base;
+    instruction_t* ip_backup;
 } call_frame_t;
 
+/**
+ * Polymorphic inline cache of one method call site. Maps receiver classes
+ * to the method the call resolved to. Parent objects are not bound by the
+ * receiver class, so each entry also records the classes of the objects
+ * walked through, `path[depth]` is the class defining the method, or NULL
+ * if the chain ended in a primitive value and the builtin is called.
+ * Classes are immutable after loading so the entries never go stale.
+ */
+typedef struct method_cache {
+    uint8_t count;
+    struct {
+        uint8_t depth;
+        obj_class_t* path[METHOD_CACHE_DEPTH];
+        obj_function_t* method;
+    } entries[METHOD_CACHE_SIZE];
+} method_cache_t;
+
+/**
+ * Inline cache of one field access. Maps classes to the index of the field
+ * in their instances, or to -1 if the class doesn't have the field and the
+ * lookup has to continue in the parent object.
+ */
+typedef struct field_cache {
+    uint8_t count;
+    struct {
+        obj_class_t* class;
+        int16_t index;
+    } entries[FIELD_CACHE_SIZE];
+} field_cache_t;
+
 typedef struct {
     call_frame_t* frames;
     size_t capacity;
     size_t length;
 } call_frames_t;
 
-void push_frame(vm_t* vm, uint8_t* ip);
-uint8_t* pop_frame(call_frames_t* call_frames);
+/// Pushes frame of the function, whose arguments are on top of the stack.
+/// @return false if the frame doesn't fit on the stack.
+bool push_frame(vm_t* vm, instruction_t* ip, obj_function_t* func, uint8_t arg_cnt);
+instruction_t* pop_frame(vm_t* vm);
 void init_frames(call_frames_t* call_frames);
 void free_frames(call_frames_t* call_frames);
 
@@ -35,24 +102,97 @@ typedef struct {
 } op_stack_t;
 
 void init_stack(op_stack_t* stack);
+/// Makes sure the stack can hold at least capacity values, the stack is never
+/// grown while interpreting.
+void reserve_stack(op_stack_t* stack, size_t capacity);
 void free_stack(op_stack_t* stack);
 void push(vm_t* stack, value_t c);
 value_t pop();
 
+/// Slots of one size class reserved for bump allocation.
+typedef struct {
+    uint8_t* top;
+    uint8_t* end;
+    size_t size;
+} bump_region_t;
+
 typedef struct vm {
     chunk_t bytecode;
-    // There can't be any writes to bytecode after this address is set.
-    uint8_t* ip;
+    // Points into the pre-decoded instructions.
+    instruction_t* ip;
     op_stack_t op_stack;
     call_frames_t frames;
-    // Contains name of the global variables as key and it's values.
+    // Number of values the stack is allocated with.
+    size_t stack_size;
+    // Function executed by interpret.
+    obj_function_t* entry;
+    // Values of the global variables, indexed by their slot.
+    value_t* globals;
+    size_t globals_count;
+    size_t globals_capacity;
+    // Contains name of the global variables as key and their slot as value.
+    // Only used when loading and for debugging, the interpreter uses the slots.
     hash_map_t global_var;
     // List of all fml objects
     obj_t* objects;
+    // Interned strings as keys, the table doesn't keep them alive. Only
+    // strings from constant pool are interned, which is always marked.
+    hash_map_t strings;
+    // Memory of the vm internal tables (global_var, strings)
+    arena_t arena;
+    // Method inline caches statistics
+    size_t method_cache_hits;
+    size_t method_cache_misses;
 
     // ==== GC Internals ====
     // If false then do not run GC
     bool gc_on;
+    gc_mode_t gc_mode;
+    // Nursery of the generational GC, objects are bump allocated in [start, end).
+    size_t nursery_size;
+    uint8_t* nursery_start;
+    uint8_t* nursery_top;
+    uint8_t* nursery_end;
+    // Old objects which may contain pointers into the nursery.
+    size_t remembered_cnt;
+    size_t remembered_capacity;
+    obj_t** remembered;
+    size_t minor_collections;
+    size_t major_collections;
+    // Full collection starts when the heap grows by this percentage of the memory
+    // which survived the last one, 0 collects only when the heap is full.
+    size_t gc_target_ratio;
+    // Number of threads marking the heap in the full collections,
+    // the pool is started by the first collection.
+    size_t gc_threads;
+    struct mark_pool* mark_pool;
+    // Mark bits of the heap objects, all of them are cleared after the sweep.
+    mark_bitmap_t mark_bits;
+    // Small objects are bump allocated from these regions by the mark-sweep and
+    // mark-compact collectors. They are given back to the heap before each collection.
+    bump_region_t bump[HEAP_SIZE_CLASSES];
+    // Full collections sweep on a background thread. It owns the objects
+    // of the background list until it is joined, survivors are left there.
+    bool concurrent_sweep;
+    bool sweeper_running;
+    pthread_t sweeper;
+    obj_t* background_list;
+    obj_t* background_tail;
+    // Incremental GC state
+    gc_phase_t gc_phase;
+    // Bytes allocated since the last slice, each slice pays them off.
+    size_t gc_debt;
+    // Maximum duration of one slice in microseconds.
+    size_t gc_pause_budget;
+    // Objects which were not swept yet, and the objects which survived
+    // the sweep so far. New objects go to the objects list while sweeping.
+    obj_t* sweep_cursor;
+    obj_t* sweep_survivors;
+    obj_t* sweep_survivors_tail;
+    // Duration of each GC pause (collection or incremental slice) in nanoseconds.
+    size_t pauses_cnt;
+    size_t pauses_capacity;
+    uint64_t* pauses;
     // The GC worklist
     size_t gray_cnt;
     size_t gray_capacity;
@@ -60,6 +200,60 @@ typedef struct vm {
 
 } vm_t;
 
+static inline bool is_young(const vm_t* vm, const obj_t* obj) {
+    return (uintptr_t)obj - (uintptr_t)vm->nursery_start < (uintptr_t)(vm->nursery_end - vm->nursery_start);
+}
+
+/// Allocates small object from the bump region of its size class, the object list
+/// and the GC fields are initialized as by alloc_obj_with_gc.
+/// @return NULL if the region is empty, the caller has to use alloc_obj_with_gc then.
+static inline obj_t* bump_alloc_obj(size_t size, vm_t* vm) {
+    if (size > HEAP_SLAB_MAX) {
+        return NULL;
+    }
+    bump_region_t* region = &vm->bump[heap_size_class(size)];
+    if ((size_t)(region->end - region->top) < region->size) {
+        return NULL;
+    }
+    obj_t* obj = (obj_t*)region->top;
+    region->top += region->size;
+    obj->forwarded = false;
+    obj->remembered = false;
+    obj->next = vm->objects;
+    vm->objects = obj;
+    return obj;
+}
+
+/// Adds the old object to the remembered set.
+void remember_object(vm_t* vm, obj_t* obj);
+
+/// Marks the object and adds it to the gray stack.
+void shade_object(vm_t* vm, obj_t* obj);
+
+/**
+ * Has to be called after storing value into a field of heap object (instance fields,
+ * array values). Roots (stack, globals) are always scanned, they don't need it.
+ *
+ * The generational GC remembers old objects pointing into the nursery, so minor collections
+ * don't have to scan the old generation. The incremental GC shades white objects stored
+ * into marked ones, so that black object never points to white one.
+ */
+static inline void gc_write_barrier(vm_t* vm, obj_t* holder, value_t val) {
+    if (!IS_OBJ(val)) {
+        return;
+    }
+    if (is_young(vm, AS_OBJ(val)) && !is_young(vm, holder) && !holder->remembered) {
+        remember_object(vm, holder);
+    } else if (vm->gc_phase == GC_MARKING && is_marked(&vm->mark_bits, holder)
+            && !is_marked(&vm->mark_bits, AS_OBJ(val))) {
+        shade_object(vm, AS_OBJ(val));
+    }
+}
+
+/// Adds global variable and returns its slot. If the variable already
+/// exists, its value is updated instead.
+uint32_t add_global(vm_t* vm, obj_string_t* name, value_t value);
+
 void init_vm(vm_t* vm);
 void free_vm(vm_t* vm);
 interpret_result_t interpret(vm_t* vm);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "include/serializer.h"
 #include "include/vm.h"
+#include "include/memory.h"
 #include "include/dissasembler.h"
 #include "include/buddy_alloc.h"
 
@@ -12,7 +13,20 @@ const char *usage =
 "        - execute - executes given bytecode\n"
 "    options:\n"
 "        --heap-log file - Logs heap activity into given file\n"
-"        --heap-size size - Limits the heap with given size in megabytes\n";
+"        --heap-size size - Limits the heap with given size in megabytes\n"
+"        --huge-pages - Backs the heap with transparent huge pages\n"
+"        --cache-stats - Prints method inline caches hits and misses at exit\n"
+"        --stack-size size - Maximum depth of the value stack in number of values\n"
+"        --gc mode - Garbage collector, one of 'mark-sweep' (default), 'mark-compact',\n"
+"            'generational' or 'incremental'\n"
+"        --gc-target-ratio percent - Collects when the heap grows by given percent of the memory\n"
+"            which survived the last collection, 0 (default) collects when the heap is full\n"
+"        --gc-threads n - Number of threads marking the heap in full collections\n"
+"        --concurrent-sweep - Sweeps the heap on a background thread after full collections,\n"
+"            needs non-zero --gc-target-ratio, collections of a full heap are swept in place\n"
+"        --gc-pause-budget us - Maximum duration of an incremental GC slice in microseconds\n"
+"        --nursery-size size - Size of the nursery of the generational GC in megabytes\n"
+"        --gc-stats - Prints number of garbage collections and pause times at exit\n";
 
 void print_usage() {
     fprintf(stderr, "%s", usage);
@@ -25,6 +39,16 @@ int main(int argc, const char* argv[]) {
     }
 
     const char* log = NULL;
+    bool cache_stats = false;
+    bool gc_stats = false;
+    bool huge_pages = false;
+    gc_mode_t gc_mode = GC_MARK_SWEEP;
+    size_t nursery_size = DEFAULT_NURSERY_SIZE;
+    size_t pause_budget = DEFAULT_GC_PAUSE_BUDGET;
+    size_t gc_threads = 1;
+    size_t gc_target_ratio = 0;
+    bool concurrent_sweep = false;
+    size_t stack_size = DEFAULT_STACK_SIZE;
     size_t heap_size = MEGABYTES(2500);
 
     // Parse command line args
@@ -36,6 +60,88 @@ int main(int argc, const char* argv[]) {
             }
             log = argv[++i];
         }
+        if (strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = true;
+        }
+        if (strcmp(argv[i], "--stack-size") == 0) {
+            if (i + 1 >= argc) {
+                print_usage();
+                exit(2);
+            }
+            stack_size = atol(argv[++i]);
+            if (stack_size == 0) {
+                print_usage();
+                exit(2);
+            }
+        }
+        if (strcmp(argv[i], "--huge-pages") == 0) {
+            huge_pages = true;
+        }
+        if (strcmp(argv[i], "--gc-stats") == 0) {
+            gc_stats = true;
+        }
+        if (strcmp(argv[i], "--gc") == 0) {
+            if (i + 1 >= argc) {
+                print_usage();
+                exit(2);
+            }
+            ++ i;
+            if (strcmp(argv[i], "mark-sweep") == 0) {
+                gc_mode = GC_MARK_SWEEP;
+            } else if (strcmp(argv[i], "mark-compact") == 0) {
+                gc_mode = GC_MARK_COMPACT;
+            } else if (strcmp(argv[i], "generational") == 0) {
+                gc_mode = GC_GENERATIONAL;
+            } else if (strcmp(argv[i], "incremental") == 0) {
+                gc_mode = GC_INCREMENTAL;
+            } else {
+                print_usage();
+                exit(2);
+            }
+        }
+        if (strcmp(argv[i], "--gc-target-ratio") == 0) {
+            if (i + 1 >= argc) {
+                print_usage();
+                exit(2);
+            }
+            gc_target_ratio = atol(argv[++i]);
+        }
+        if (strcmp(argv[i], "--gc-threads") == 0) {
+            if (i + 1 >= argc) {
+                print_usage();
+                exit(2);
+            }
+            gc_threads = atol(argv[++i]);
+            if (gc_threads == 0) {
+                print_usage();
+                exit(2);
+            }
+        }
+        if (strcmp(argv[i], "--concurrent-sweep") == 0) {
+            concurrent_sweep = true;
+        }
+        if (strcmp(argv[i], "--gc-pause-budget") == 0) {
+            if (i + 1 >= argc) {
+                print_usage();
+                exit(2);
+            }
+            pause_budget = atol(argv[++i]);
+            if (pause_budget == 0) {
+                print_usage();
+                exit(2);
+            }
+        }
+        if (strcmp(argv[i], "--nursery-size") == 0) {
+            if (i + 1 >= argc) {
+                print_usage();
+                exit(2);
+            }
+            nursery_size = MEGABYTES(atol(argv[++i]));
+            if (nursery_size == 0) {
+                print_usage();
+                exit(2);
+            }
+        }
         if (strcmp(argv[i], "--heap-size") == 0) {
             if (i + 1 >= argc) {
                 print_usage();
@@ -51,15 +157,23 @@ int main(int argc, const char* argv[]) {
 
     /* Initialize memory */
 #ifndef __SYSTEM_MEMORY__
-    void* mempool = malloc(heap_size);
+    void* mempool = heap_reserve(heap_size, huge_pages);
     if (mempool == NULL) {
         fprintf(stderr, "Failed to allocate memory from the OS.\n");
+        exit(11);
     }
     heap_init(mempool, heap_size, log);
 #endif
 
     vm_t vm;
     init_vm(&vm);
+    vm.stack_size = stack_size;
+    vm.gc_mode = gc_mode;
+    vm.nursery_size = nursery_size;
+    vm.gc_pause_budget = pause_budget;
+    vm.gc_threads = gc_threads;
+    vm.gc_target_ratio = gc_target_ratio;
+    vm.concurrent_sweep = concurrent_sweep;
     parse(&vm, argv[2]);
 
 #ifdef __DEBUG__
@@ -83,6 +197,13 @@ int main(int argc, const char* argv[]) {
         exit(22);
     }
 
+    if (cache_stats) {
+        fprintf(stderr, "Method cache: %zu hits, %zu misses\n", vm.method_cache_hits, vm.method_cache_misses);
+    }
+    if (gc_stats) {
+        print_gc_stats(stderr, &vm);
+    }
+
     free_vm(&vm);
 
 #ifdef __DEBUG__
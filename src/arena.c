@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "include/arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+void init_arena(arena_t* arena) {
+    arena->chunks = NULL;
+    arena->allocated = 0;
+}
+
+void free_arena(arena_t* arena) {
+    while (arena->chunks != NULL) {
+        arena_chunk_t* next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    init_arena(arena);
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arena_chunk_t* chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = aligned_alloc(ARENA_ALIGNMENT, (sizeof(*chunk) + chunk_size + ARENA_ALIGNMENT - 1)
+                                               & ~(size_t)(ARENA_ALIGNMENT - 1));
+        if (chunk == NULL) {
+            fprintf(stderr, "Arena run out of memory.\n");
+            exit(37);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->allocated += size;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+static void* arena_alloc_fn(size_t size, void* ctx) {
+    return arena_alloc(ctx, size);
+}
+
+static void arena_free_fn(void* ptr, size_t size, void* ctx) {
+    (void)ptr; (void)size; (void)ctx;
+}
+
+allocator_t arena_allocator(arena_t* arena) {
+    return (allocator_t){ .alloc = arena_alloc_fn, .free = arena_free_fn, .ctx = arena };
+}
+
+static void* system_alloc_fn(size_t size, void* ctx) {
+    (void)ctx;
+    return calloc(1, size);
+}
+
+static void system_free_fn(void* ptr, size_t size, void* ctx) {
+    (void)size; (void)ctx;
+    free(ptr);
+}
+
+allocator_t system_allocator(void) {
+    return (allocator_t){ .alloc = system_alloc_fn, .free = system_free_fn, .ctx = NULL };
+}
@@ -1,17 +1,26 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "include/buddy_alloc.h"
 
 /**
  * If macro __SYSTEM_MEMORY__ is defined, then system memory allocations function will be called
  * instead. So heap_alloc will call malloc, heap_free will call free and so on...
+ *
+ * Small allocations (up to HEAP_SLAB_MAX) are served from size classes. Each class
+ * carves buddy blocks of RUN_SIZE (runs) into equal slots, allocating a slot is a pop
+ * from the free list of the run. Buddy blocks are at least 64 bytes and aligned to
+ * their size, so their data start frag_size bytes after a multiple of 64. Slots are
+ * granule aligned, which tells them apart from the buddy blocks.
  */
 
 
@@ -19,21 +28,58 @@
 #define MIN_BLOCK_SIZE (64 - (frag_size))
 #define LEVELS 64
 #define MAGIC_VAL 22131232
+/* Set in the taken field of the blocks carved into slots */
+#define RUN_FLAG 2
+#define RUN_SIZE (16 * 1024UL)
+/* Pages of free blocks at least this big are given back to the OS */
+#define RELEASE_MIN_SIZE (2 * 1024 * 1024UL)
+/* Offset of the first slot from the run fragment, after the run header */
+#define RUN_DATA_OFFSET ((frag_size + sizeof(struct slab_run) + HEAP_GRANULE - 1) & ~(HEAP_GRANULE - 1))
 
 static struct fragment *mem_arr[LEVELS];
 static size_t heap_size;
 static size_t heap_taken;
 static struct fragment *mem;
 static size_t taken_blocks;
+/* Runs of each class with free slots */
+static struct slab_run *partial_runs[HEAP_SIZE_CLASSES];
+static size_t class_runs[HEAP_SIZE_CLASSES];
+static size_t class_used[HEAP_SIZE_CLASSES];
+/* Memory returned by heap_reserve, its free pages can be discarded */
+static void *reserved_pool;
+static bool release_pages;
+static size_t page_size;
+// Heap usage at which the next collection should start, 0 if it wasn't set yet
+static size_t gc_trigger;
 FILE* flog;
+// The heap is locked only while it is shared with another thread (the background sweeper)
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool heap_shared;
+
+#define LOCK_HEAP() do { if (heap_shared) pthread_mutex_lock(&heap_lock); } while (0)
+#define UNLOCK_HEAP() do { if (heap_shared) pthread_mutex_unlock(&heap_lock); } while (0)
 
 struct fragment {
-    /* Next free segment in the same level */
+    /* Next free segment in the same level, the previous one is stored
+       in the data of the free segment (see prev_link) */
     struct fragment *next;
     size_t size;
     unsigned taken;
 };
 
+/* Header of a run, stored in the data of its fragment */
+struct slab_run {
+    /* Runs of the same class with free slots */
+    struct slab_run *next;
+    struct slab_run *prev;
+    /* Offsets from the run fragment, of the first free slot (0 if there
+       is none) and of the first slot which was never allocated */
+    uint32_t free;
+    uint32_t top;
+    uint32_t used;
+    uint32_t cls;
+};
+
 static bool get_taken(struct fragment *f) { return f->taken & 1; }
 
 static void set_taken(struct fragment *f, bool val) {
@@ -48,31 +94,42 @@ static void swap(struct fragment **x, struct fragment **y) {
 }
 
 static bool is_block(struct fragment *f) {
-    return (f->taken & 0xfffffffe) == (MAGIC_VAL & 0xfffffffe);
+    return (f->taken & 0xfffffffc) == (MAGIC_VAL & 0xfffffffc);
 }
 
 static size_t log2int(size_t num) {
-    ssize_t pow = 0;
-    while (num /= 2UL)
-        pow += 1;
-    return pow;
+    return num == 0 ? 0 : 63 - __builtin_clzl(num);
+}
+
+static size_t ceil_log2(size_t num) {
+    return num <= 1 ? 0 : log2int(num - 1) + 1;
+}
+
+/* Free lists are doubly linked, so that a fragment can be unlinked in constant
+   time when it is merged with its buddy. The back link is kept in the first word
+   of the fragment data, which is unused while the fragment is free, so the header
+   of the taken blocks doesn't grow. */
+static struct fragment **prev_link(struct fragment *f) {
+    return (struct fragment **)(f + 1);
 }
 
 static void add_free(struct fragment *f, size_t i) {
     f->next = mem_arr[i];
+    *prev_link(f) = NULL;
+    if (mem_arr[i])
+        *prev_link(mem_arr[i]) = f;
     mem_arr[i] = f;
 }
 
 static void remove_free(struct fragment *f, size_t i) {
-    struct fragment *walk = mem_arr[i];
+    struct fragment *prev = *prev_link(f);
 
-    if (walk == f) {
+    if (prev)
+        prev->next = f->next;
+    else
         mem_arr[i] = f->next;
-        return;
-    }
-    while (walk->next != f)
-        walk = walk->next;
-    walk->next = f->next;
+    if (f->next)
+        *prev_link(f->next) = prev;
 }
 
 static struct fragment *buddy_addr(struct fragment *f, size_t i) {
@@ -84,10 +141,48 @@ static struct fragment *buddy_addr(struct fragment *f, size_t i) {
        before buddy. If we 6th bit, if it's zero it will add 64, if it's one it
        will substract 64, so we will get the address either way.
     */
-    return (struct fragment *)((((uint8_t *)f - (uint8_t *)mem) ^ (1 << i)) +
+    return (struct fragment *)((((uint8_t *)f - (uint8_t *)mem) ^ (1UL << i)) +
                                (uint8_t *)mem);
 }
 
+/* Free blocks of level i whose pages are given back to the OS */
+static bool releases_pages(size_t i) {
+    return release_pages && (1UL << i) >= RELEASE_MIN_SIZE;
+}
+
+/* Part of the free block which was written since its pages were last released,
+   as [lo, hi) offsets from the fragment. Only the blocks whose pages are released
+   track it, it is kept after the free list back link. */
+static size_t *dirty_range(struct fragment *f) {
+    return (size_t *)(prev_link(f) + 1);
+}
+
+static void set_dirty(struct fragment *f, size_t lo, size_t hi) {
+    if (lo >= hi)
+        lo = hi = 0;
+    dirty_range(f)[0] = lo;
+    dirty_range(f)[1] = hi;
+}
+
+/* Discards the dirty pages of the free block of level i, except the page with the
+   header, the free list links and the dirty range. The OS gives zeroed pages when
+   they are touched again. */
+static void release_block(struct fragment *f, size_t i) {
+    size_t *dirty = dirty_range(f);
+    if (dirty[0] >= dirty[1])
+        return;
+    uintptr_t keep = ((uintptr_t)(dirty + 2) + page_size - 1) & ~(page_size - 1);
+    uintptr_t start = ((uintptr_t)f + dirty[0]) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)f + dirty[1] + page_size - 1) & ~(page_size - 1);
+    if (start < keep)
+        start = keep;
+    if (end > (uintptr_t)f + (1UL << i))
+        end = (uintptr_t)f + (1UL << i);
+    if (start < end)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    set_dirty(f, 0, 0);
+}
+
 static void split(struct fragment *f, size_t i) {
     size_t new_size = (f->size + frag_size) / 2;
 
@@ -101,13 +196,60 @@ static void split(struct fragment *f, size_t i) {
     add_free(buddy, i - 1);
 }
 
-void heap_log(char action) {
+static void write_log(char action) {
     if (flog != NULL) {
-        fprintf(flog, "%lu,%c,%lu\n", (unsigned long)time(NULL), action, heap_taken);
+        // Without trigger the collection starts when the heap is full
+        size_t trigger = gc_trigger == 0 || gc_trigger > heap_size ? heap_size : gc_trigger;
+        fprintf(flog, "%lu,%c,%lu,%lu\n", (unsigned long)time(NULL), action, heap_taken, trigger);
     }
 }
 
+void heap_log(char action) {
+    LOCK_HEAP();
+    write_log(action);
+    UNLOCK_HEAP();
+}
+
+void heap_set_shared(bool shared) {
+    heap_shared = shared;
+}
+
+void heap_set_gc_trigger(size_t bytes) {
+    LOCK_HEAP();
+    gc_trigger = bytes;
+    UNLOCK_HEAP();
+}
+
+size_t heap_gc_trigger() {
+    LOCK_HEAP();
+    size_t trigger = gc_trigger;
+    UNLOCK_HEAP();
+    return trigger;
+}
+
+bool heap_gc_due() {
+    LOCK_HEAP();
+    bool due = gc_trigger != 0 && heap_taken >= gc_trigger;
+    UNLOCK_HEAP();
+    return due;
+}
+
 #ifndef __SYSTEM_MEMORY__
+void* heap_reserve(size_t size, bool huge_pages) {
+    void *pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && madvise(pool, size, MADV_HUGEPAGE) != 0)
+        fprintf(stderr, "Warning: Huge pages are not available for the heap.\n");
+#else
+    if (huge_pages)
+        fprintf(stderr, "Warning: Huge pages are not available for the heap.\n");
+#endif
+    reserved_pool = pool;
+    return pool;
+}
+
 void heap_init(void *mem_pool, size_t mem_size, const char* log)
 {
     if (log != NULL) {
@@ -116,7 +258,7 @@ void heap_init(void *mem_pool, size_t mem_size, const char* log)
             fprintf(stderr, "Couldn't open file for logging.\n");
             exit(33);
         }
-        fprintf(flog, "timestamp,event,heap\n");
+        fprintf(flog, "timestamp,event,heap,trigger\n");
         heap_log('S');
     }
 
@@ -125,7 +267,15 @@ void heap_init(void *mem_pool, size_t mem_size, const char* log)
     }
     for (size_t i = 0; i < LEVELS; ++ i)
         mem_arr[i] = NULL;
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i) {
+        partial_runs[i] = NULL;
+        class_runs[i] = class_used[i] = 0;
+    }
     taken_blocks = 0;
+    release_pages = mem_pool != NULL && mem_pool == reserved_pool;
+    page_size = sysconf(_SC_PAGESIZE);
+    heap_taken = 0;
+    gc_trigger = 0;
     heap_size = 0;
     mem = (struct fragment*)mem_pool;
     /* Try to allocate as much memory as possible */
@@ -140,37 +290,52 @@ void heap_init(void *mem_pool, size_t mem_size, const char* log)
         *rem = (struct fragment){NULL, new_size - frag_size, MAGIC_VAL};
         set_taken(rem, 0);
         add_free(rem, i);
+        /* The pool may have been used before */
+        if (releases_pages(i))
+            set_dirty(rem, 0, new_size);
         heap_size += new_size;
     }
 }
 
-void *heap_alloc(size_t size) {
+static void *alloc_block(size_t size) {
     if (size < MIN_BLOCK_SIZE)
         size = MIN_BLOCK_SIZE;
-    size_t i = log2int(size + frag_size) + 1;
-    while (!mem_arr[i]) {
+    /* The smallest level whose blocks fit the data with the header */
+    size_t level = ceil_log2(size + frag_size);
+    if (size + frag_size < size)
+        return NULL;
+    size_t i = level;
+    while (i < LEVELS && !mem_arr[i])
         i++;
-        if (i >= LEVELS) {
-            return NULL;
-        }
-    }
+    if (i >= LEVELS)
+        return NULL;
     struct fragment *walk = mem_arr[i];
     set_taken(walk, true);
     remove_free(walk, i);
-    /* Try to split the block while it's size is larger than the wanted size */
-    while ((walk->size - frag_size) / 2 - frag_size > size &&
-           (walk->size - frag_size) / 2 > MIN_BLOCK_SIZE)
+    /* Split the block until it has the wanted level, each half keeps its part of the dirty range */
+    while (i > level) {
         split(walk, i--);
+        if (releases_pages(i)) {
+            size_t half = 1UL << i;
+            size_t lo = dirty_range(walk)[0], hi = dirty_range(walk)[1];
+            struct fragment *buddy = (struct fragment *)((uint8_t *)walk + half);
+            set_dirty(buddy, lo > half ? lo - half : 0, hi > half ? hi - half : 0);
+            set_dirty(walk, lo < half ? lo : half, hi < half ? hi : half);
+        }
+    }
 
-    taken_blocks++;
     assert(walk->size >= size);
-    heap_taken += walk->size;
-    heap_log('A');
+    // Count the whole block, header included
+    heap_taken += walk->size + frag_size;
+    write_log('A');
     return walk + 1;
 }
 
 static struct fragment *merge(struct fragment *f, size_t i) {
     struct fragment *b = buddy_addr(f, i);
+    /* The last block of the heap has no buddy if heap_size is not a power of two */
+    if ((size_t)((uint8_t *)b - (uint8_t *)mem) >= heap_size)
+        return NULL;
     if (b->size != f->size || get_taken(b))
         return NULL;
     if (b < f)
@@ -178,6 +343,26 @@ static struct fragment *merge(struct fragment *f, size_t i) {
     assert(is_block(b) && is_block(f));
     assert(f != b);
 
+    if (releases_pages(i + 1)) {
+        size_t half = 1UL << i;
+        if (!releases_pages(i)) {
+            /* The halves don't track what was written */
+            set_dirty(f, 0, 2 * half);
+        } else {
+            /* The header page of the upper half is inside of the merged block now */
+            size_t lo = half, hi = half + page_size;
+            size_t *low = dirty_range(f), *high = dirty_range(b);
+            if (low[0] < low[1]) {
+                lo = low[0] < lo ? low[0] : lo;
+                hi = low[1] > hi ? low[1] : hi;
+            }
+            if (high[0] < high[1]) {
+                hi = half + high[1] > hi ? half + high[1] : hi;
+            }
+            set_dirty(f, lo, hi);
+        }
+    }
+
     remove_free(b, i);
     remove_free(f, i);
 
@@ -187,26 +372,259 @@ static struct fragment *merge(struct fragment *f, size_t i) {
     return f;
 }
 
-bool heap_free(void *blk) {
+static bool free_block(void *blk) {
     struct fragment *f = (struct fragment *)blk - 1;
-    if (!blk || !is_block(f))
+    if (!is_block(f))
         return false;
     set_taken(f, false);
-    heap_taken -= f->size;
+    heap_taken -= f->size + frag_size;
 
     size_t i = log2int(f->size + frag_size);
 
     add_free(f, i);
+    if (releases_pages(i))
+        set_dirty(f, 0, 1UL << i);
     /* Try to merge fragments until fragment size does not exceed max heap size
      */
-    while (2 * f->size + frag_size <= heap_size)
-        if (!(f = merge(f, i++)))
+    while (2 * f->size + frag_size <= heap_size) {
+        struct fragment *merged = merge(f, i);
+        if (!merged)
             break;
+        f = merged;
+        i++;
+    }
+    /* The pages are released by heap_release_pages, not under the heap lock */
+
+    return true;
+}
+
+/* Grows or shrinks the taken block in place. Shrinking splits the block and frees
+   the upper halves. Growing merges the block with its free buddies, which is possible
+   only if the block is the lower half on every level up to the wanted one.
+   Returns false if the block has to be moved. */
+static bool resize_block(struct fragment *f, size_t size) {
+    if (size < MIN_BLOCK_SIZE)
+        size = MIN_BLOCK_SIZE;
+    if (size + frag_size < size)
+        return false;
+    size_t level = log2int(f->size + frag_size);
+    size_t target = ceil_log2(size + frag_size);
+    if (target <= level) {
+        heap_taken -= (1UL << level) - (1UL << target);
+        while (level > target) {
+            split(f, level--);
+            if (releases_pages(level))
+                set_dirty((struct fragment *)((uint8_t *)f + (1UL << level)), 0, 1UL << level);
+        }
+        write_log('A');
+        return true;
+    }
+
+    size_t offset = (uint8_t *)f - (uint8_t *)mem;
+    if (target >= LEVELS || (offset & ((1UL << target) - 1)) || offset + (1UL << target) > heap_size)
+        return false;
+    for (size_t i = level; i < target; ++ i) {
+        struct fragment *b = (struct fragment *)((uint8_t *)f + (1UL << i));
+        if (b->size + frag_size != (1UL << i) || get_taken(b))
+            return false;
+    }
+    for (size_t i = level; i < target; ++ i)
+        remove_free((struct fragment *)((uint8_t *)f + (1UL << i)), i);
+    heap_taken += (1UL << target) - (1UL << level);
+    f->size = (1UL << target) - frag_size;
+    write_log('A');
+    return true;
+}
+
+/* ============= SIZE CLASSES =============== */
+
+static bool is_slot(void *blk) {
+    return (((uint8_t *)blk - (uint8_t *)mem) & (HEAP_GRANULE - 1)) == 0;
+}
+
+/* The run containing the slot, runs are aligned to their size */
+static struct fragment *run_fragment(void *slot) {
+    size_t offset = (uint8_t *)slot - (uint8_t *)mem;
+    return (struct fragment *)((uint8_t *)mem + (offset & ~(RUN_SIZE - 1)));
+}
+
+static struct slab_run *run_header(struct fragment *f) {
+    return (struct slab_run *)(f + 1);
+}
+
+static bool run_full(struct slab_run *run) {
+    return !run->free && run->top + heap_class_size(run->cls) > RUN_SIZE;
+}
+
+static void link_run(struct slab_run *run) {
+    run->prev = NULL;
+    run->next = partial_runs[run->cls];
+    if (run->next)
+        run->next->prev = run;
+    partial_runs[run->cls] = run;
+}
+
+static void unlink_run(struct slab_run *run) {
+    if (run->prev)
+        run->prev->next = run->next;
+    else
+        partial_runs[run->cls] = run->next;
+    if (run->next)
+        run->next->prev = run->prev;
+}
+
+static struct slab_run *new_run(size_t cls) {
+    void *blk = alloc_block(RUN_SIZE - frag_size);
+    if (!blk)
+        return NULL;
+    struct fragment *f = (struct fragment *)blk - 1;
+    f->taken |= RUN_FLAG;
+    struct slab_run *run = run_header(f);
+    *run = (struct slab_run){NULL, NULL, 0, RUN_DATA_OFFSET, 0, cls};
+    link_run(run);
+    class_runs[cls]++;
+    return run;
+}
+
+/* Pops a slot of the size class, NULL if there is no memory for a new run */
+static void *alloc_slot(size_t size) {
+    size_t cls = heap_size_class(size);
+    struct slab_run *run = partial_runs[cls];
+    if (!run && !(run = new_run(cls)))
+        return NULL;
+    uint8_t *base = (uint8_t *)run - frag_size;
+    uint8_t *slot;
+    if (run->free) {
+        slot = base + run->free;
+        run->free = *(uint32_t *)slot;
+    } else {
+        slot = base + run->top;
+        run->top += heap_class_size(cls);
+    }
+    run->used++;
+    class_used[cls]++;
+    if (run_full(run))
+        unlink_run(run);
+    return slot;
+}
 
-    taken_blocks--;
+static bool free_slot(void *slot) {
+    struct fragment *f = run_fragment(slot);
+    if (!is_block(f) || !get_taken(f) || !(f->taken & RUN_FLAG))
+        return false;
+    struct slab_run *run = run_header(f);
+    size_t offset = (uint8_t *)slot - (uint8_t *)f;
+    if (offset < RUN_DATA_OFFSET || offset >= run->top || (offset - RUN_DATA_OFFSET) % heap_class_size(run->cls))
+        return false;
+    if (run_full(run))
+        link_run(run);
+    *(uint32_t *)slot = run->free;
+    run->free = offset;
+    run->used--;
+    class_used[run->cls]--;
+    /* Keep the last partial run of the class, so that the run isn't
+       allocated and freed again and again */
+    if (run->used == 0 && (run->prev || run->next)) {
+        unlink_run(run);
+        class_runs[run->cls]--;
+        f->taken &= ~RUN_FLAG;
+        free_block(f + 1);
+    }
+    return true;
+}
+
+bool heap_reserve_slots(size_t cls, uint8_t** start, uint8_t** end) {
+    LOCK_HEAP();
+    size_t size = heap_class_size(cls);
+    struct slab_run *run = partial_runs[cls];
+    /* Slots freed by the GC are reused first, they are allocated from the free list */
+    if (run && run->free && run->top + size > RUN_SIZE) {
+        UNLOCK_HEAP();
+        return false;
+    }
+    if (!run)
+        run = new_run(cls);
+    if (!run) {
+        UNLOCK_HEAP();
+        return false;
+    }
+    uint8_t *base = (uint8_t *)run - frag_size;
+    size_t count = (RUN_SIZE - run->top) / size;
+    *start = base + run->top;
+    *end = *start + count * size;
+    run->top += count * size;
+    run->used += count;
+    class_used[cls] += count;
+    taken_blocks += count;
+    if (run_full(run))
+        unlink_run(run);
+    UNLOCK_HEAP();
     return true;
 }
 
+void heap_release_slots(uint8_t* start, uint8_t* end) {
+    if (start == end)
+        return;
+    LOCK_HEAP();
+    struct fragment *f = run_fragment(start);
+    struct slab_run *run = run_header(f);
+    size_t count = (end - start) / heap_class_size(run->cls);
+    /* Nothing is allocated after the reserved slots, so the top just moves back */
+    assert((size_t)(end - (uint8_t *)f) == run->top);
+    bool full = run_full(run);
+    run->top = start - (uint8_t *)f;
+    run->used -= count;
+    class_used[run->cls] -= count;
+    taken_blocks -= count;
+    if (full)
+        link_run(run);
+    UNLOCK_HEAP();
+}
+
+/* ============= ALLOCATION =============== */
+
+static void *alloc_any(size_t size) {
+    void *blk = NULL;
+    if (size <= HEAP_SLAB_MAX)
+        blk = alloc_slot(size);
+    /* Without memory for a new run the small block is taken from the buddies */
+    if (!blk)
+        blk = alloc_block(size);
+    if (blk)
+        taken_blocks++;
+    return blk;
+}
+
+static bool free_any(void *blk) {
+    if (!blk)
+        return false;
+    bool freed = is_slot(blk) ? free_slot(blk) : free_block(blk);
+    if (freed)
+        taken_blocks--;
+    return freed;
+}
+
+/* Number of bytes the block can hold */
+static size_t block_capacity(void *blk) {
+    if (is_slot(blk))
+        return heap_class_size(run_header(run_fragment(blk))->cls);
+    return ((struct fragment *)blk - 1)->size;
+}
+
+void *heap_alloc(size_t size) {
+    LOCK_HEAP();
+    void* blk = alloc_any(size);
+    UNLOCK_HEAP();
+    return blk;
+}
+
+bool heap_free(void *blk) {
+    LOCK_HEAP();
+    bool freed = free_any(blk);
+    UNLOCK_HEAP();
+    return freed;
+}
+
 void* heap_realloc(void* blk, size_t new_size) {
     if (blk == NULL) {
         return heap_alloc(new_size);
@@ -215,26 +633,170 @@ void* heap_realloc(void* blk, size_t new_size) {
         heap_free(blk);
         return NULL;
     }
-    void* new_blk = heap_alloc(new_size);
-    if (new_blk == NULL) {
-        return NULL;
+    LOCK_HEAP();
+    size_t old_size = block_capacity(blk);
+    // The slot already has the right size class
+    if (is_slot(blk) && new_size <= HEAP_SLAB_MAX
+            && heap_class_size(heap_size_class(new_size)) == old_size) {
+        UNLOCK_HEAP();
+        return blk;
     }
-    struct fragment *f = (struct fragment*)blk - 1;
-    memcpy(new_blk, blk, f->size);
-    heap_free(blk);
+    if (!is_slot(blk) && resize_block((struct fragment *)blk - 1, new_size)) {
+        UNLOCK_HEAP();
+        return blk;
+    }
+    void* new_blk = alloc_any(new_size);
+    if (new_blk != NULL) {
+        memcpy(new_blk, blk, old_size < new_size ? old_size : new_size);
+        free_any(blk);
+    }
+    UNLOCK_HEAP();
     return new_blk;
 }
 
+void heap_class_stats(heap_class_stats_t stats[HEAP_SIZE_CLASSES]) {
+    LOCK_HEAP();
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i) {
+        size_t slots = (RUN_SIZE - RUN_DATA_OFFSET) / heap_class_size(i);
+        stats[i] = (heap_class_stats_t){heap_class_size(i), class_runs[i], class_used[i], class_runs[i] * slots};
+    }
+    UNLOCK_HEAP();
+}
+
 void* heap_calloc(size_t num, size_t size) {
     void* new_blk = heap_alloc(num * size);
     memset(new_blk, 0, num * size);
     return new_blk;
 }
 
+/// End of the top level block containing the offset. The heap is made of
+/// blocks of decreasing power of two sizes, one for each bit of heap_size.
+static size_t region_end(size_t offset) {
+    size_t end = 0;
+    for (size_t i = LEVELS; i-- > 0;) {
+        if (heap_size & (1UL << i)) {
+            end += 1UL << i;
+            if (offset < end) {
+                return end;
+            }
+        }
+    }
+    return heap_size;
+}
+
+/// Splits the free range of the heap into the biggest aligned blocks and adds them to the free lists.
+static void add_free_range(size_t start, size_t end) {
+    while (start < end) {
+        size_t limit = region_end(start);
+        if (limit > end) {
+            limit = end;
+        }
+        size_t i = log2int(limit - start);
+        while (start & ((1UL << i) - 1)) {
+            i--;
+        }
+        struct fragment *f = (struct fragment *)((uint8_t *)mem + start);
+        *f = (struct fragment){NULL, (1UL << i) - frag_size, MAGIC_VAL};
+        set_taken(f, false);
+        add_free(f, i);
+        if (releases_pages(i))
+            set_dirty(f, 0, 1UL << i);
+        start += 1UL << i;
+    }
+}
+
+void heap_plan_compaction() {
+    size_t cursor = 0;
+    size_t block;
+    for (size_t offset = 0; offset < heap_size; offset += block) {
+        struct fragment *f = (struct fragment *)((uint8_t *)mem + offset);
+        block = f->size + frag_size;
+        if (get_taken(f)) {
+            // Blocks keep their alignment, so they can still be merged with their
+            // buddies. The target is never after the block, it was aligned too.
+            size_t target = (cursor + block - 1) & ~(block - 1);
+            // The free list link is not used by the taken blocks
+            f->next = (struct fragment *)((uint8_t *)mem + target);
+            cursor = target + block;
+        }
+    }
+}
+
+void* heap_forward(void* blk) {
+    if (blk == NULL) {
+        return NULL;
+    }
+    // Slots move with their run
+    if (is_slot(blk)) {
+        struct fragment *run = run_fragment(blk);
+        return (uint8_t *)run->next + ((uint8_t *)blk - (uint8_t *)run);
+    }
+    struct fragment *f = (struct fragment *)blk - 1;
+    return f->next + 1;
+}
+
+void heap_compact() {
+    for (size_t i = 0; i < LEVELS; ++ i)
+        mem_arr[i] = NULL;
+    // The partial runs are linked again at their new addresses
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i)
+        partial_runs[i] = NULL;
+    size_t free_start = 0;
+    size_t block;
+    for (size_t offset = 0; offset < heap_size; offset += block) {
+        struct fragment *f = (struct fragment *)((uint8_t *)mem + offset);
+        block = f->size + frag_size;
+        if (get_taken(f)) {
+            size_t target = (uint8_t *)f->next - (uint8_t *)mem;
+            // Blocks are moved in address order towards the start, so neither
+            // the moved block nor the free range overwrite blocks not moved yet.
+            add_free_range(free_start, target);
+            memmove((uint8_t *)mem + target, f, block);
+            free_start = target + block;
+            struct fragment *moved = (struct fragment *)((uint8_t *)mem + target);
+            if ((moved->taken & RUN_FLAG) && !run_full(run_header(moved)))
+                link_run(run_header(moved));
+        }
+    }
+    add_free_range(free_start, heap_size);
+    write_log('C');
+}
+
+void heap_release_pages() {
+    if (!release_pages)
+        return;
+    for (size_t i = log2int(RELEASE_MIN_SIZE); i < LEVELS; ++ i) {
+        for (struct fragment *f = mem_arr[i]; f; f = f->next)
+            release_block(f, i);
+    }
+}
+
 size_t heap_done() { return taken_blocks; }
 
+void* heap_start() { return mem; }
+
+size_t heap_capacity() { return heap_size; }
+
+size_t heap_available() {
+    LOCK_HEAP();
+    size_t available = heap_size - heap_taken;
+    UNLOCK_HEAP();
+    return available;
+}
+
+size_t heap_used() {
+    LOCK_HEAP();
+    size_t used = heap_taken;
+    UNLOCK_HEAP();
+    return used;
+}
+
 #else
 
+void* heap_reserve(size_t size, bool huge_pages) {
+    return malloc(size);
+}
+
 void heap_init(void* mem_pool, size_t mem_size) {
     free(mem_pool);
 }
@@ -256,7 +818,33 @@ void* heap_calloc(size_t cnt, size_t size) {
     return calloc(cnt, size);
 }
 
+void heap_plan_compaction() {}
+
+void* heap_forward(void* blk) { return blk; }
+
+void heap_compact() {}
+
+void heap_release_pages() {}
+
+bool heap_reserve_slots(size_t cls, uint8_t** start, uint8_t** end) {
+    return false;
+}
+
+void heap_release_slots(uint8_t* start, uint8_t* end) {}
+
+void heap_class_stats(heap_class_stats_t stats[HEAP_SIZE_CLASSES]) {
+    memset(stats, 0, sizeof(heap_class_stats_t) * HEAP_SIZE_CLASSES);
+}
+
 size_t heap_done() { return 0; }
 
+void* heap_start() { return NULL; }
+
+size_t heap_capacity() { return 0; }
+
+size_t heap_available() { return SIZE_MAX; }
+
+size_t heap_used() { return 0; }
+
 #endif
 
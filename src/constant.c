@@ -42,24 +42,19 @@ size_t add_constant(constant_pool_t* pool, value_t constant) {
     return pool->len - 1;
 }
 
+/// Objects in the pool are owned by the vm objects list, they are freed
+/// together with the other objects in free_vm.
 void free_constant_pool(constant_pool_t* pool) {
-    for(size_t i = 0; i < pool->len; ++ i) {
-        if (pool->data[i].type != TYPE_OBJECT)
-            continue;
-        heap_free(AS_STRING(pool->data[i]));
-    }
     heap_free(pool->data);
     init_constant_pool(pool);
 }
 
 static obj_t* allocate_obj(size_t size, obj_type_t type, vm_t* vm) {
-    obj_t* obj = alloc_with_gc(size, vm);
+    obj_t* obj = bump_alloc_obj(size, vm);
+    if (obj == NULL) {
+        obj = alloc_obj_with_gc(size, vm);
+    }
     obj->type = type;
-    // GC: Object is not marked at init
-    obj->marked = false;
-    // Add to object list
-    obj->next = vm->objects;
-    vm->objects = obj;
     return obj;
 }
 
@@ -74,6 +69,16 @@ obj_string_t* build_obj_string(size_t len, const char* ptr, uint32_t hash, vm_t*
     return new_string;
 }
 
+obj_string_t* intern_obj_string(size_t len, const char* ptr, uint32_t hash, vm_t* vm) {
+    obj_string_t* interned = hash_map_find_string(&vm->strings, ptr, len, hash);
+    if (interned != NULL) {
+        return interned;
+    }
+    obj_string_t* str = build_obj_string(len, ptr, hash, vm);
+    hash_map_insert(&vm->strings, str, NULL_VAL);
+    return str;
+}
+
 /// Allocates function object on heap and returns pointer to it,
 /// fields of function are zero initialized
 /// with exception of object, which is initialized correctly.
@@ -81,8 +86,10 @@ obj_function_t* build_obj_fun(vm_t* vm) {
     obj_function_t* fun = (obj_function_t*)allocate_obj(sizeof(*fun), OBJ_FUNCTION, vm);
     fun->args = 0;
     fun->entry_point = 0;
+    fun->code_entry = 0;
     fun->length = 0;
     fun->locals = 0;
+    fun->max_stack = 0;
     fun->name = 0;
     return fun;
 }
@@ -97,11 +104,11 @@ bool is_obj_type(value_t val, obj_type_t type) {
     return IS_OBJ(val) && AS_OBJ(val)->type == type;
 }
 
-obj_array_t* build_obj_array(size_t size, value_t init, vm_t* vm) {
+obj_array_t* build_obj_array(size_t size, const value_t* init, vm_t* vm) {
     obj_array_t* obj = (obj_array_t*)allocate_obj(sizeof(*obj) + size * sizeof(*obj->values), OBJ_ARRAY, vm);
     obj->size = size;
     for (size_t i = 0; i < size; ++ i) {
-        obj->values[i] = init;
+        obj->values[i] = *init;
     }
     return obj;
 }
@@ -109,15 +116,15 @@ obj_array_t* build_obj_array(size_t size, value_t init, vm_t* vm) {
 obj_class_t* build_obj_class(vm_t* vm) {
     obj_class_t* obj = (obj_class_t*)allocate_obj(sizeof(*obj), OBJ_CLASS, vm);
     obj->size = 0;
-    init_hash_map(&obj->methods);
+    init_hash_map(&obj->methods, gc_allocator(vm));
     return obj;
 }
 
-obj_instance_t* build_obj_instance(obj_class_t* class, hash_map_t fields, value_t extends, vm_t* vm) {
-    obj_instance_t* obj = (obj_instance_t*)allocate_obj(sizeof(*obj), OBJ_INSTANCE, vm);
-    obj->extends = extends;
-    obj->class = class;
-    obj->fields = fields;
+obj_instance_t* build_obj_instance(const value_t* class, const value_t* fields, const value_t* extends, vm_t* vm) {
+    obj_instance_t* obj = (obj_instance_t*)allocate_obj(sizeof(*obj) + AS_CLASS(*class)->size * sizeof(*obj->fields), OBJ_INSTANCE, vm);
+    obj->extends = *extends;
+    obj->class = AS_CLASS(*class);
+    memcpy(obj->fields, fields, obj->class->size * sizeof(*obj->fields));
     return obj;
 }
 
@@ -126,3 +133,14 @@ obj_native_fun_t* build_obj_native(native_fun_t fun, vm_t* vm) {
     obj->fun = fun;
     return obj;
 }
+
+void free_object(obj_t* obj) {
+    if (obj->type == OBJ_CLASS) {
+        free_hash_map(&((obj_class_t*)obj)->methods);
+    }
+#ifdef __STRESS_GC__
+    // Make use of freed objects visible
+    obj->type = (obj_type_t)-1;
+#endif
+    heap_free(obj);
+}
@@ -57,10 +57,8 @@ void dissasemble_object(FILE* stream, obj_t* obj) {
                 }
             }
             for (size_t i = 0; i < instance->class->size; ++ i) {
-                value_t val;
-                assert(hash_map_fetch(&instance->fields, instance->class->fields[i], &val));
                 fprintf(stream, "%s=", instance->class->fields[i]->data);
-                dissasemble_value(stream, val);
+                dissasemble_value(stream, instance->fields[i]);
                 if (i + 1 != instance->class->size) {
                     fprintf(stream, ", ");
                 }
@@ -82,18 +80,18 @@ void dissasemble_object(FILE* stream, obj_t* obj) {
 }
 
 void dissasemble_value(FILE* stream, value_t val) {
-    switch (val.type) {
+    switch (VALUE_TYPE(val)) {
         case TYPE_NULL:
             fprintf(stream, "null");
             break;
         case TYPE_BOOLEAN:
-            fprintf(stream, "%s", val.b ? "true" : "false");
+            fprintf(stream, "%s", AS_BOOL(val) ? "true" : "false");
             break;
         case TYPE_INTEGER:
-            fprintf(stream, "Int: %d", val.num);
+            fprintf(stream, "Int: %d", AS_NUMBER(val));
             break;
         case TYPE_OBJECT: {
-            dissasemble_object(stream, val.obj);
+            dissasemble_object(stream, AS_OBJ(val));
             break;
         }
         default:
@@ -204,7 +202,7 @@ void dissasemble_global_variables(FILE* stream, vm_t* vm) {
         if (vm->global_var.entries[i].key != NULL) {
             printf("%zu: ", i);
             printf("%s - ", vm->global_var.entries[i].key->data);
-            dissasemble_value(stream, vm->global_var.entries[i].value);
+            dissasemble_value(stream, vm->globals[AS_NUMBER(vm->global_var.entries[i].value)]);
             puts("");
         }
     }
@@ -0,0 +1,343 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "include/gc_parallel.h"
+#include "include/memory.h"
+#include "include/objects.h"
+#include "include/mark_bitmap.h"
+
+#define DEQUE_INIT_SIZE 1024
+// Avoid false sharing between the deques of different workers
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    int64_t size;
+    _Atomic(obj_t*) buffer[];
+} deque_array_t;
+
+/**
+ * Chase-Lev work stealing deque, as described in "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (Le et al.). Only the owner pushes
+ * and takes at the bottom, other workers steal from the top.
+ */
+typedef struct {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(deque_array_t*) array;
+    // Arrays replaced by the bigger ones, thieves may still read them
+    // so they are freed when the marking ends.
+    size_t retired_cnt;
+    size_t retired_capacity;
+    deque_array_t** retired;
+} deque_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) deque_t deque;
+    size_t id;
+    pthread_t thread;
+    mark_pool_t* pool;
+} mark_worker_t;
+
+struct mark_pool {
+    size_t count;
+    mark_worker_t* workers;
+    // Number of workers which may still produce gray objects,
+    // the marking is done when it drops to zero.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t active;
+    pthread_mutex_t lock;
+    // Signalled when a new marking starts
+    pthread_cond_t start;
+    // Signalled when the last worker thread finishes the marking
+    pthread_cond_t done;
+    size_t epoch;
+    size_t running;
+    bool shutdown;
+    // Mark bits of the current marking
+    mark_bitmap_t* marks;
+};
+
+// Returned by steal when it lost the race for the top element
+#define STEAL_ABORT ((obj_t*)1)
+
+static deque_array_t* new_deque_array(int64_t size) {
+    deque_array_t* array = malloc(sizeof(deque_array_t) + sizeof(_Atomic(obj_t*)) * size);
+    if (array == NULL) {
+        fprintf(stderr, "Failed to allocate the GC mark deque.\n");
+        exit(11);
+    }
+    array->size = size;
+    return array;
+}
+
+static void init_deque(deque_t* deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, new_deque_array(DEQUE_INIT_SIZE));
+    deque->retired_cnt = 0;
+    deque->retired_capacity = 0;
+    deque->retired = NULL;
+}
+
+static void free_retired(deque_t* deque) {
+    for (size_t i = 0; i < deque->retired_cnt; ++i) {
+        free(deque->retired[i]);
+    }
+    deque->retired_cnt = 0;
+}
+
+static void free_deque(deque_t* deque) {
+    free_retired(deque);
+    free(deque->retired);
+    free(atomic_load_explicit(&deque->array, memory_order_relaxed));
+}
+
+static deque_array_t* grow_deque(deque_t* deque, deque_array_t* array, int64_t top, int64_t bottom) {
+    deque_array_t* bigger = new_deque_array(array->size * 2);
+    for (int64_t i = top; i < bottom; ++i) {
+        obj_t* obj = atomic_load_explicit(&array->buffer[i & (array->size - 1)], memory_order_relaxed);
+        atomic_store_explicit(&bigger->buffer[i & (bigger->size - 1)], obj, memory_order_relaxed);
+    }
+    if (deque->retired_cnt >= deque->retired_capacity) {
+        deque->retired_capacity = deque->retired_capacity == 0 ? 8 : deque->retired_capacity * 2;
+        deque->retired = realloc(deque->retired, sizeof(*deque->retired) * deque->retired_capacity);
+    }
+    deque->retired[deque->retired_cnt++] = array;
+    atomic_store_explicit(&deque->array, bigger, memory_order_release);
+    return bigger;
+}
+
+static void deque_push(deque_t* deque, obj_t* obj) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top > array->size - 1) {
+        array = grow_deque(deque, array, top, bottom);
+    }
+    atomic_store_explicit(&array->buffer[bottom & (array->size - 1)], obj, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/// Pops from the bottom, only the owner can take. Returns NULL if the deque is empty.
+static obj_t* deque_take(deque_t* deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // Empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    obj_t* obj = atomic_load_explicit(&array->buffer[bottom & (array->size - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // Last element, race with the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            obj = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return obj;
+}
+
+/// Pops from the top. Returns NULL if the deque is empty and STEAL_ABORT
+/// if another worker took the element first.
+static obj_t* deque_steal(deque_t* deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    obj_t* obj = atomic_load_explicit(&array->buffer[top & (array->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return STEAL_ABORT;
+    }
+    return obj;
+}
+
+static bool deque_empty(deque_t* deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    return top >= bottom;
+}
+
+static void mark_object(obj_t* obj, mark_worker_t* worker) {
+    // Setting the mark bit decides which worker claims the object
+    if (obj != NULL && set_mark_atomic(worker->pool->marks, obj)) {
+        deque_push(&worker->deque, obj);
+    }
+}
+
+static void mark_child(obj_t* child, void* worker) {
+    mark_object(child, worker);
+}
+
+static obj_t* steal_work(mark_worker_t* worker) {
+    mark_pool_t* pool = worker->pool;
+    bool retry = true;
+    while (retry) {
+        retry = false;
+        for (size_t i = 1; i < pool->count; ++i) {
+            mark_worker_t* victim = &pool->workers[(worker->id + i) % pool->count];
+            obj_t* obj = deque_steal(&victim->deque);
+            if (obj == STEAL_ABORT) {
+                retry = true;
+            } else if (obj != NULL) {
+                return obj;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Called when the worker has no work. Returns false when all the workers
+ * are out of work, so the marking is finished, true if there may be
+ * some work to steal.
+ */
+static bool wait_for_work(mark_worker_t* worker) {
+    mark_pool_t* pool = worker->pool;
+    atomic_fetch_sub(&pool->active, 1);
+    for (;;) {
+        if (atomic_load(&pool->active) == 0) {
+            return false;
+        }
+        for (size_t i = 0; i < pool->count; ++i) {
+            if (!deque_empty(&pool->workers[i].deque)) {
+                atomic_fetch_add(&pool->active, 1);
+                return true;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static void drain(mark_worker_t* worker) {
+    for (;;) {
+        obj_t* obj = deque_take(&worker->deque);
+        if (obj == NULL) {
+            obj = steal_work(worker);
+        }
+        if (obj != NULL) {
+            for_each_child(obj, mark_child, worker);
+        } else if (!wait_for_work(worker)) {
+            return;
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    mark_worker_t* worker = arg;
+    mark_pool_t* pool = worker->pool;
+    size_t epoch = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->epoch == epoch && !pool->shutdown) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        epoch = pool->epoch;
+        pthread_mutex_unlock(&pool->lock);
+
+        drain(worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+mark_pool_t* create_mark_pool(size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    mark_pool_t* pool = malloc(sizeof(mark_pool_t));
+    mark_worker_t* workers = aligned_alloc(CACHE_LINE_SIZE, sizeof(mark_worker_t) * threads);
+    if (pool == NULL || workers == NULL) {
+        fprintf(stderr, "Failed to allocate the GC mark pool.\n");
+        exit(11);
+    }
+    pool->count = threads;
+    pool->workers = workers;
+    atomic_init(&pool->active, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->epoch = 0;
+    pool->running = 0;
+    pool->shutdown = false;
+    pool->marks = NULL;
+
+    for (size_t i = 0; i < threads; ++i) {
+        init_deque(&workers[i].deque);
+        workers[i].id = i;
+        workers[i].pool = pool;
+    }
+    // The first worker is the thread which calls parallel_mark
+    for (size_t i = 1; i < threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start the GC mark thread.\n");
+            exit(11);
+        }
+    }
+    return pool;
+}
+
+void free_mark_pool(mark_pool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->count; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < pool->count; ++i) {
+        free_deque(&pool->workers[i].deque);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+void parallel_mark(mark_pool_t* pool, mark_bitmap_t* marks, obj_t** gray, size_t gray_cnt) {
+    pool->marks = marks;
+    // The workers are parked, so the roots can be pushed to their deques
+    for (size_t i = 0; i < gray_cnt; ++i) {
+        deque_push(&pool->workers[i % pool->count].deque, gray[i]);
+    }
+    atomic_store(&pool->active, pool->count);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = pool->count - 1;
+    pool->epoch += 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    drain(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->count; ++i) {
+        free_retired(&pool->workers[i].deque);
+    }
+}
@@ -12,59 +12,127 @@
 #include "include/dissasembler.h"
 #include "include/buddy_alloc.h"
 
-void init_hash_map(hash_map_t* hm) {
+void init_hash_map(hash_map_t* hm, allocator_t allocator) {
     memset(hm, 0, sizeof(*hm));
+    hm->allocator = allocator;
 }
 
 void free_hash_map(hash_map_t* hm) {
-    heap_free(hm->entries);
-    init_hash_map(hm);
+    if (hm->entries != NULL) {
+        hm->allocator.free(hm->entries, hm->capacity * sizeof(*hm->entries), hm->allocator.ctx);
+    }
+    init_hash_map(hm, hm->allocator);
 }
 
-/// djb2 hash function, taken from http://www.cse.yorku.ca/~oz/hash.html.
-unsigned long hash_string(const char *str)
+uint32_t hash_string(const char *str)
 {
-    unsigned long hash = 5381;
-    int c;
+    return hash_bytes(str, strlen(str));
+}
+
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
 
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+/// Folds the word into 32 bits. The upper half of the product depends
+/// on all bits of the word, only it is kept since keys store 32 bit hashes.
+static inline uint32_t hash_fold(uint64_t h) {
+    h ^= h >> 32;
+    return (uint32_t)((h * HASH_MULTIPLIER) >> 32);
+}
+
+uint32_t hash_bytes(const char *str, size_t length)
+{
+    uint64_t hash = length * HASH_MULTIPLIER;
+    uint64_t word;
+
+    // Consume the string eight bytes at a time, memcpy is needed
+    // because the data don't have to be aligned.
+    size_t i = 0;
+    for (; i + sizeof(word) <= length; i += sizeof(word)) {
+        memcpy(&word, str + i, sizeof(word));
+        hash = (hash ^ word) * HASH_MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+
+    // Remaining bytes are padded with zeros, the length is already mixed
+    // in so strings differing only in trailing zeros differ.
+    if (i < length) {
+        word = 0;
+        memcpy(&word, str + i, length - i);
+        hash = (hash ^ word) * HASH_MULTIPLIER;
     }
 
-    return hash;
+    return hash_fold(hash);
+}
+
+/// Distance of the entry from the index its key hashes to.
+static inline size_t probe_distance(const entry_t* entry, size_t index, size_t mask) {
+    return (index - entry->key->hash) & mask;
 }
 
-/// Finds either existing entry or place where it can be inserted. Uses linear probing.
+/**
+ * Finds entry with given key. Robin Hood hashing keeps the entries of a cluster ordered
+ * by their distance from home, so the search can stop at the first entry closer to its
+ * home than the key would be. The capacity is always power of two, so the index can be
+ * masked instead of divided.
+ * @return The entry or NULL if the key is not present.
+ */
 static entry_t* hash_map_find_entry(entry_t* entries, size_t capacity, obj_string_t* key) {
-    uint32_t index = key->hash % capacity;
-    entry_t* tombstone = NULL;
+    size_t mask = capacity - 1;
+    size_t index = key->hash & mask;
+    size_t distance = 0;
 
     for(;;) {
         entry_t* entry = &entries[index];
-
-        // Save tombstone if encountered.
-        if (entry->key == NULL) {
-            // Return tombstone if it was encountered.
-            if (IS_BOOL(entry->value) && AS_BOOL(entry->value)) {
-                // Save only the first occurence of the tombstone
-                if (tombstone == NULL) {
-                    tombstone = entry;
-                }
-            } else {
-                return tombstone != NULL ? tombstone : entry;
-            }
         // Comparing by pointers, this is okay since
-        // strings in constant pool are always the same
-        } else if (strcmp(entry->key->data, key->data) == 0) {
+        // strings in constant pool are interned
+        if (entry->key == key) {
             return entry;
         }
+        if (entry->key == NULL || probe_distance(entry, index, mask) < distance) {
+            return NULL;
+        }
+
+        index = (index + 1) & mask;
+        distance += 1;
+    }
+}
+
+/**
+ * Places key, which is not yet in the map, into the entries. Entries that are closer to their
+ * home index than the inserted one are displaced further ("robbed"), which keeps the variance
+ * of probe lengths low.
+ */
+static void hash_map_place(entry_t* entries, size_t capacity, obj_string_t* key, value_t value) {
+    size_t mask = capacity - 1;
+    size_t index = key->hash & mask;
+    size_t distance = 0;
+
+    for(;;) {
+        entry_t* entry = &entries[index];
+        if (entry->key == NULL) {
+            entry->key = key;
+            entry->value = value;
+            return;
+        }
+
+        size_t entry_distance = probe_distance(entry, index, mask);
+        if (entry_distance < distance) {
+            obj_string_t* tmp_key = entry->key;
+            value_t tmp_value = entry->value;
+            entry->key = key;
+            entry->value = value;
+            key = tmp_key;
+            value = tmp_value;
+            distance = entry_distance;
+        }
 
-        index = (index + 1) % capacity;
+        index = (index + 1) & mask;
+        distance += 1;
     }
 }
 
 static void hash_map_resize(hash_map_t *hm, size_t capacity) {
-    entry_t* entries = calloc(capacity, sizeof(*entries));
+    assert((capacity & (capacity - 1)) == 0);
+    entry_t* entries = hm->allocator.alloc(capacity * sizeof(*entries), hm->allocator.ctx);
     if (entries == NULL) {
         fprintf(stderr, "HashMap run out of memory.\n");
         exit(37);
@@ -73,17 +141,15 @@ static void hash_map_resize(hash_map_t *hm, size_t capacity) {
     // Reinsert all keys into new memory
     for (size_t i = 0; i < hm->capacity; ++ i) {
         entry_t* entry = &hm->entries[i];
-        // This also works for graves, since they have NULL key.
         if (entry->key == NULL) {
             continue;
         }
-
-        entry_t* dest = hash_map_find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        hash_map_place(entries, capacity, entry->key, entry->value);
     }
 
-    heap_free(hm->entries);
+    if (hm->entries != NULL) {
+        hm->allocator.free(hm->entries, hm->capacity * sizeof(*hm->entries), hm->allocator.ctx);
+    }
     hm->entries = entries;
     hm->capacity = capacity;
 }
@@ -99,19 +165,19 @@ bool hash_map_insert(hash_map_t* hm, obj_string_t* key, value_t value) {
         exit(33);
     }
 #endif
-    if (hm->count >= hm->capacity * HASH_MAP_LOAD_BALANCE) {
-        hash_map_resize(hm, NEW_CAPACITY(hm->capacity));
+    if (hm->count + 1 > hm->capacity * HASH_MAP_LOAD_BALANCE) {
+        hash_map_resize(hm, hm->capacity == 0 ? HASH_MAP_INIT_CAPACITY : hm->capacity * 2);
     }
-    entry_t* entry = hash_map_find_entry(hm->entries, hm->capacity, key);
-    bool is_new = entry->key == NULL;
 
-    if (is_new && !IS_GRAVE(entry)) {
-        hm->count += 1;
+    entry_t* entry = hash_map_find_entry(hm->entries, hm->capacity, key);
+    if (entry != NULL) {
+        entry->value = value;
+        return false;
     }
 
-    entry->key = key;
-    entry->value = value;
-    return is_new;
+    hash_map_place(hm->entries, hm->capacity, key, value);
+    hm->count += 1;
+    return true;
 }
 
 bool hash_map_fetch(hash_map_t* hm, obj_string_t* key, value_t* value) {
@@ -120,7 +186,7 @@ bool hash_map_fetch(hash_map_t* hm, obj_string_t* key, value_t* value) {
     }
 
     entry_t* entry = hash_map_find_entry(hm->entries, hm->capacity, key);
-    if (entry->key == NULL) {
+    if (entry == NULL) {
         return false;
     }
 
@@ -134,13 +200,28 @@ bool hash_map_delete(hash_map_t* hm, obj_string_t* key) {
     }
 
     entry_t* entry = hash_map_find_entry(hm->entries, hm->capacity, key);
-    if (entry->key == NULL) {
+    if (entry == NULL) {
         return false;
     }
 
-    // Create tombstone
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // Backward shift deletion, move the following entries of the cluster one place
+    // back until an empty entry or an entry at its home index is found.
+    size_t mask = hm->capacity - 1;
+    size_t index = entry - hm->entries;
+    for (;;) {
+        size_t next_index = (index + 1) & mask;
+        entry_t* next = &hm->entries[next_index];
+        if (next->key == NULL || probe_distance(next, next_index, mask) == 0) {
+            break;
+        }
+        hm->entries[index] = *next;
+        index = next_index;
+    }
+
+    // Empty entries look the same as the ones from calloc, so that
+    // the GC doesn't see stale values in them.
+    memset(&hm->entries[index], 0, sizeof(hm->entries[index]));
+    hm->count -= 1;
     return true;
 }
 
@@ -150,10 +231,32 @@ bool hash_map_update(hash_map_t* hm, obj_string_t* key, value_t new_val) {
     }
 
     entry_t* entry = hash_map_find_entry(hm->entries, hm->capacity, key);
-    if (entry->key == NULL) {
+    if (entry == NULL) {
         return false;
     }
 
     entry->value = new_val;
     return true;
 }
+
+obj_string_t* hash_map_find_string(hash_map_t* hm, const char* chars, size_t length, uint32_t hash) {
+    if (hm->count == 0) {
+        return NULL;
+    }
+
+    size_t mask = hm->capacity - 1;
+    size_t index = hash & mask;
+    size_t distance = 0;
+    for (;;) {
+        entry_t* entry = &hm->entries[index];
+        if (entry->key == NULL || probe_distance(entry, index, mask) < distance) {
+            return NULL;
+        } else if (entry->key->hash == hash && entry->key->length == length
+                   && memcmp(entry->key->data, chars, length) == 0) {
+            return entry->key;
+        }
+
+        index = (index + 1) & mask;
+        distance += 1;
+    }
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "include/mark_bitmap.h"
+
+void init_mark_bitmap(mark_bitmap_t* bitmap) {
+    bitmap->words = NULL;
+    bitmap->count = 0;
+    bitmap->base = 0;
+}
+
+void reserve_mark_bitmap(mark_bitmap_t* bitmap) {
+    size_t count = ((heap_capacity() >> HEAP_GRANULE_SHIFT) + 63) / 64;
+    if (bitmap->base == (uintptr_t)heap_start() && bitmap->count == count) {
+        return;
+    }
+    free(bitmap->words);
+    bitmap->words = calloc(count, sizeof(*bitmap->words));
+    if (bitmap->words == NULL && count != 0) {
+        fprintf(stderr, "Failed to allocate the GC mark bitmap.\n");
+        exit(11);
+    }
+    bitmap->count = count;
+    bitmap->base = (uintptr_t)heap_start();
+}
+
+void free_mark_bitmap(mark_bitmap_t* bitmap) {
+    free(bitmap->words);
+    init_mark_bitmap(bitmap);
+}
+
+void clear_mark_bitmap(mark_bitmap_t* bitmap) {
+    memset(bitmap->words, 0, bitmap->count * sizeof(*bitmap->words));
+}
@@ -1,27 +1,42 @@
 #include <memory.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <assert.h>
+#include <time.h>
 #include "include/memory.h"
 #include "include/objects.h"
 #include "include/vm.h"
 #include "include/constant.h"
 #include "include/buddy_alloc.h"
 #include "include/dissasembler.h"
+#include "include/gc_parallel.h"
+#include "include/mark_bitmap.h"
 
-static void mark_object(obj_t* obj, vm_t* vm) {
-    // Check that we don't visit already visited object
-    if (obj != NULL && !obj->marked) {
-        obj->marked = true;
+// Objects bigger than this fraction of the nursery are allocated in the old generation.
+#define NURSERY_LARGE_OBJECT_FRACTION 4
+#define NURSERY_ALIGNMENT 16
 
-        if (vm->gray_cnt >= vm->gray_capacity) {
-            vm->gray_capacity = NEW_CAPACITY(vm->gray_capacity);
-            // Use the system function, not heap_realloc
-            vm->gray_stack = realloc(vm->gray_stack, sizeof(*vm->gray_stack) * vm->gray_capacity);
-        }
+static void push_gray(obj_t* obj, vm_t* vm) {
+    if (vm->gray_cnt >= vm->gray_capacity) {
+        vm->gray_capacity = NEW_CAPACITY(vm->gray_capacity);
+        // Use the system function, not heap_realloc
+        vm->gray_stack = realloc(vm->gray_stack, sizeof(*vm->gray_stack) * vm->gray_capacity);
+    }
+
+    vm->gray_stack[vm->gray_cnt ++] = obj;
+}
 
-        vm->gray_stack[vm->gray_cnt ++] = obj;
+static void mark_object(obj_t* obj, vm_t* vm) {
+    // Check that we don't visit already visited object
+    if (obj != NULL && set_mark(&vm->mark_bits, obj)) {
+        push_gray(obj, vm);
     }
 }
 
+void shade_object(vm_t* vm, obj_t* obj) {
+    mark_object(obj, vm);
+}
+
 static void mark_val(value_t val, vm_t* vm) {
     // PODs are not allocated on heap
     if (IS_OBJ(val)) {
@@ -38,31 +53,24 @@ static void mark_table(hash_map_t* table, vm_t* vm) {
 }
 
 static void mark_roots(vm_t* vm) {
-    // Mark everything that is on the stack
+    // Mark everything that is on the stack, local variables of the frames included
     for (size_t i = 0; i < vm->op_stack.size; ++i) {
         mark_val(vm->op_stack.data[i], vm);
     }
 
     // Mark global variables
     mark_table(&vm->global_var, vm);
+    for (size_t i = 0; i < vm->globals_count; ++i) {
+        mark_val(vm->globals[i], vm);
+    }
 
     // Mark everything in constant pool
     for (size_t i = 0; i < vm->bytecode.pool.len; ++i) {
         mark_val(vm->bytecode.pool.data[i], vm);
     }
-
-    // Mark local variables in each frame
-    for (size_t i = 0; i < vm->frames.length; ++i) {
-        for (size_t j = 0; j < MAX_LOCALS; ++ j) {
-            mark_val(vm->frames.frames[i].locals_vector[j], vm);
-        }
-    }
 }
 
-/**
- * Used to mark internal objects of other object (ie. for arrays, it marks all the values in the array)
- */
-static void blacken(obj_t* obj, vm_t* vm) {
+void for_each_child(obj_t* obj, child_visitor_t visitor, void* ctx) {
     switch (obj->type) {
         case OBJ_STRING:
         case OBJ_NATIVE:
@@ -72,25 +80,40 @@ static void blacken(obj_t* obj, vm_t* vm) {
             break;
         case OBJ_INSTANCE: {
             obj_instance_t* i = (obj_instance_t*)obj;
-            mark_object((obj_t*)i->class, vm);
-            mark_val(i->extends, vm);
-            mark_table(&i->fields, vm);
+            visitor((obj_t*)i->class, ctx);
+            if (IS_OBJ(i->extends)) {
+                visitor(AS_OBJ(i->extends), ctx);
+            }
+            for (size_t j = 0; j < i->class->size; ++j) {
+                if (IS_OBJ(i->fields[j])) {
+                    visitor(AS_OBJ(i->fields[j]), ctx);
+                }
+            }
             break;
         }
         case OBJ_ARRAY: {
             obj_array_t* arr = (obj_array_t*)obj;
-            mark_object(&arr->obj, vm);
             for (size_t i = 0; i < arr->size; ++i) {
-                mark_val(arr->values[i], vm);
+                if (IS_OBJ(arr->values[i])) {
+                    visitor(AS_OBJ(arr->values[i]), ctx);
+                }
             }
             break;
         }
         case OBJ_CLASS: {
             obj_class_t* class = (obj_class_t*)obj;
             for (size_t i = 0; i < class->size; ++i) {
-                mark_object(&class->fields[i]->obj, vm);
+                visitor(&class->fields[i]->obj, ctx);
+            }
+            for (size_t i = 0; i < class->methods.capacity; ++i) {
+                entry_t* entry = &class->methods.entries[i];
+                if (entry->key != NULL) {
+                    visitor(&entry->key->obj, ctx);
+                }
+                if (IS_OBJ(entry->value)) {
+                    visitor(AS_OBJ(entry->value), ctx);
+                }
             }
-            mark_table(&class->methods, vm);
             break;
         }
         default:
@@ -99,6 +122,17 @@ static void blacken(obj_t* obj, vm_t* vm) {
     }
 }
 
+static void mark_child(obj_t* child, void* vm) {
+    mark_object(child, vm);
+}
+
+/**
+ * Used to mark internal objects of other object (ie. for arrays, it marks all the values in the array)
+ */
+static void blacken(obj_t* obj, vm_t* vm) {
+    for_each_child(obj, mark_child, vm);
+}
+
 static void trace_references(vm_t* vm) {
     while (vm->gray_cnt > 0) {
         obj_t* obj = vm->gray_stack[--vm->gray_cnt];
@@ -106,14 +140,15 @@ static void trace_references(vm_t* vm) {
     }
 }
 
-static void sweep(vm_t* vm) {
+/// Frees the unmarked objects of the list, the marks are cleared by the caller.
+/// @return The surviving objects, the last of them is stored into tail.
+static obj_t* sweep_list(obj_t* list, obj_t** tail, mark_bitmap_t* marks) {
     // Helper previous node to keep the object list
     obj_t* prev = NULL;
-    obj_t* obj = vm->objects;
+    obj_t* obj = list;
     while (obj != NULL) {
         // Do not sweep marked, just move in the list
-        if (obj->marked) {
-            obj->marked = false;
+        if (is_marked(marks, obj)) {
             prev = obj;
             obj = obj->next;
         } else {
@@ -131,26 +166,747 @@ static void sweep(vm_t* vm) {
             // We're at the beginning, so replace the old list start with
             // new one.
             } else {
-                vm->objects = obj;
+                list = obj;
             }
-            heap_free(white);
+            free_object(white);
         }
     }
+    *tail = prev;
+    return list;
 }
 
-void run_gc(vm_t* vm) {
+static void sweep(vm_t* vm) {
+    obj_t* tail;
+    vm->objects = sweep_list(vm->objects, &tail, &vm->mark_bits);
+    clear_mark_bitmap(&vm->mark_bits);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record_pause(vm_t* vm, uint64_t pause) {
+    if (vm->pauses_cnt >= vm->pauses_capacity) {
+        vm->pauses_capacity = NEW_CAPACITY(vm->pauses_capacity);
+        vm->pauses = realloc(vm->pauses, sizeof(*vm->pauses) * vm->pauses_capacity);
+    }
+    vm->pauses[vm->pauses_cnt ++] = pause;
+}
+
+/* ============= GC TRIGGER =============== */
+
+// Smallest heap usage which starts a collection with the target ratio
+#define GC_MIN_TRIGGER (4 * 1024 * 1024)
+
+/// Sets the heap usage at which the next collection starts, called when the
+/// heap contains only the objects which survived the last collection.
+static void update_trigger(vm_t* vm) {
+    size_t live = heap_used();
+    size_t trigger = SIZE_MAX;
+    if (vm->gc_target_ratio != 0) {
+        // The heap can grow by the ratio of the surviving size
+        trigger = live + live / 100 * vm->gc_target_ratio;
+        if (trigger < GC_MIN_TRIGGER) {
+            trigger = GC_MIN_TRIGGER;
+        }
+    } else if (vm->gc_mode == GC_INCREMENTAL) {
+        // Start the next cycle when half of the free memory is used
+        trigger = live + heap_available() / 2;
+    }
+    heap_set_gc_trigger(trigger);
+}
+
+/// True if the heap grew enough to start the next collection.
+static bool gc_due(vm_t* vm) {
+    // The first trigger is set from the memory taken by the loaded program
+    if (heap_gc_trigger() == 0) {
+        update_trigger(vm);
+    }
+    return heap_gc_due();
+}
+
+/* ============= CONCURRENT SWEEP =============== */
+
+static void* background_sweep(void* arg) {
+    vm_t* vm = arg;
+    // The mutator doesn't touch the background list until the thread is joined
+    vm->background_list = sweep_list(vm->background_list, &vm->background_tail, &vm->mark_bits);
+    clear_mark_bitmap(&vm->mark_bits);
+    update_trigger(vm);
+    return NULL;
+}
+
+/// Hands the marked objects over to the sweeper thread. The object list starts
+/// empty, objects allocated from now on belong to the next cycle and the sweeper
+/// never sees them, so they don't need to be marked.
+// The heap is swept in the background only if at least this fraction of it is free
+#define SWEEP_MIN_HEADROOM 8
+
+static void start_background_sweep(vm_t* vm) {
+    vm->background_list = vm->objects;
+    vm->objects = NULL;
+    // The trigger is set by the sweeper when the garbage is freed
+    heap_set_gc_trigger(SIZE_MAX);
+    heap_set_shared(true);
+    if (pthread_create(&vm->sweeper, NULL, background_sweep, vm) != 0) {
+        // Sweep in this thread instead
+        heap_set_shared(false);
+        vm->objects = vm->background_list;
+        vm->background_list = NULL;
+        sweep(vm);
+        heap_release_pages();
+        update_trigger(vm);
+        return;
+    }
+    vm->sweeper_running = true;
+}
+
+/// Waits for the sweeper thread and returns the survivors to the object list.
+/// Has to be called before the marking, which would race with the sweeper on the mark bits.
+/// @return true if the sweeper was running, so some memory may have been freed.
+static bool finish_background_sweep(vm_t* vm) {
+    if (!vm->sweeper_running) {
+        return false;
+    }
+    // The mutator is stopped while it waits
+    uint64_t start = now_ns();
+    pthread_join(vm->sweeper, NULL);
+    record_pause(vm, now_ns() - start);
+    vm->sweeper_running = false;
+    heap_set_shared(false);
+    heap_release_pages();
+    if (vm->background_list != NULL) {
+        vm->background_tail->next = vm->objects;
+        vm->objects = vm->background_list;
+    }
+    vm->background_list = vm->background_tail = NULL;
+    return true;
+}
+
+/// Size of the object in bytes, including the trailing data.
+static size_t object_size(obj_t* obj) {
+    switch (obj->type) {
+        case OBJ_STRING:
+            return sizeof(obj_string_t) + ((obj_string_t*)obj)->length + 1;
+        case OBJ_ARRAY:
+            return sizeof(obj_array_t) + ((obj_array_t*)obj)->size * sizeof(value_t);
+        case OBJ_INSTANCE:
+            return sizeof(obj_instance_t) + ((obj_instance_t*)obj)->class->size * sizeof(value_t);
+        case OBJ_CLASS:
+            return sizeof(obj_class_t);
+        case OBJ_FUNCTION:
+            return sizeof(obj_function_t);
+        case OBJ_NATIVE:
+            return sizeof(obj_native_fun_t);
+        case OBJ_SLOT:
+            return sizeof(obj_slot_t);
+    }
+    fprintf(stderr, "Unknown object type in GC");
+    exit(21);
+}
+
+/// Bytes of the old generation that are kept free, so that the whole nursery
+/// can always be promoted. Buddy blocks can be up to twice the object size.
+static size_t promotion_reserve(vm_t* vm) {
+    return 2 * (size_t)(vm->nursery_end - vm->nursery_start);
+}
+
+void remember_object(vm_t* vm, obj_t* obj) {
+    if (vm->remembered_cnt >= vm->remembered_capacity) {
+        vm->remembered_capacity = NEW_CAPACITY(vm->remembered_capacity);
+        vm->remembered = realloc(vm->remembered, sizeof(*vm->remembered) * vm->remembered_capacity);
+    }
+    obj->remembered = true;
+    vm->remembered[vm->remembered_cnt ++] = obj;
+}
+
+/// Copies the young object into the old generation, the nursery copy
+/// is left with forwarding pointer.
+static obj_t* promote(obj_t* obj, vm_t* vm) {
+    if (obj->forwarded) {
+        return obj->next;
+    }
+    size_t size = object_size(obj);
+    obj_t* copy = heap_alloc(size);
+    if (copy == NULL) {
+        fprintf(stderr, "The heap is not big enough to promote object of size %lu\n", size);
+        exit(11);
+    }
+    memcpy(copy, obj, size);
+    copy->next = vm->objects;
+    vm->objects = copy;
+
+    obj->forwarded = true;
+    obj->next = copy;
+    // Fields of the copy may still point into the nursery.
+    push_gray(copy, vm);
+    return copy;
+}
+
+static void promote_val(value_t* val, vm_t* vm) {
+    if (IS_OBJ(*val) && is_young(vm, AS_OBJ(*val))) {
+        *val = OBJ_VAL(promote(AS_OBJ(*val), vm));
+    }
+}
+
+/// Promotes the young objects referenced by the old object.
+static void promote_fields(obj_t* obj, vm_t* vm) {
+    switch (obj->type) {
+        case OBJ_INSTANCE: {
+            obj_instance_t* instance = (obj_instance_t*)obj;
+            promote_val(&instance->extends, vm);
+            for (size_t i = 0; i < instance->class->size; ++i) {
+                promote_val(&instance->fields[i], vm);
+            }
+            break;
+        }
+        case OBJ_ARRAY: {
+            obj_array_t* arr = (obj_array_t*)obj;
+            for (size_t i = 0; i < arr->size; ++i) {
+                promote_val(&arr->values[i], vm);
+            }
+            break;
+        }
+        // Other objects are created only when loading the program,
+        // they can't point into the nursery.
+        default:
+            break;
+    }
+}
+
+/**
+ * Minor collection, copies live objects of the nursery into the old generation.
+ * The roots are the stack, the globals and the remembered set, the constant
+ * pool contains only old objects.
+ */
+static void collect_nursery(vm_t* vm) {
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < vm->op_stack.size; ++i) {
+        promote_val(&vm->op_stack.data[i], vm);
+    }
+    for (size_t i = 0; i < vm->globals_count; ++i) {
+        promote_val(&vm->globals[i], vm);
+    }
+    for (size_t i = 0; i < vm->remembered_cnt; ++i) {
+        vm->remembered[i]->remembered = false;
+        promote_fields(vm->remembered[i], vm);
+    }
+    vm->remembered_cnt = 0;
+
+    while (vm->gray_cnt > 0) {
+        promote_fields(vm->gray_stack[--vm->gray_cnt], vm);
+    }
+
+#if defined(__DEBUG__) || defined(__STRESS_GC__)
+    // Catch references to objects which were not promoted
+    memset(vm->nursery_start, 0xAB, vm->nursery_top - vm->nursery_start);
+#endif
+    vm->nursery_top = vm->nursery_start;
+    vm->minor_collections += 1;
+    heap_log('m');
+    record_pause(vm, now_ns() - start);
+}
+
+/* ============= BUMP ALLOCATION =============== */
+
+/// Gives the unused slots of the bump regions back to the heap, the collector
+/// sees only the allocated objects.
+static void release_bump_regions(vm_t* vm) {
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i) {
+        heap_release_slots(vm->bump[i].top, vm->bump[i].end);
+        vm->bump[i].top = vm->bump[i].end = NULL;
+    }
+}
+
+/// Reserves new bump region for the size class of the object, if the region is empty.
+/// The incremental and generational collectors have to see every allocation,
+/// the stress test collects on every allocation.
+static void refill_bump_region(size_t size, vm_t* vm) {
+#ifndef __STRESS_GC__
+    if (size > HEAP_SLAB_MAX || (vm->gc_mode != GC_MARK_SWEEP && vm->gc_mode != GC_MARK_COMPACT)) {
+        return;
+    }
+    bump_region_t* region = &vm->bump[heap_size_class(size)];
+    if ((size_t)(region->end - region->top) < region->size) {
+        heap_release_slots(region->top, region->end);
+        if (!heap_reserve_slots(heap_size_class(size), &region->top, &region->end)) {
+            region->top = region->end = NULL;
+        }
+    }
+#endif
+}
+
+/// Marks everything reachable from the roots.
+static void mark_heap(vm_t* vm) {
+    release_bump_regions(vm);
+    reserve_mark_bitmap(&vm->mark_bits);
+    mark_roots(vm);
+    if (vm->gc_threads > 1) {
+        if (vm->mark_pool == NULL) {
+            vm->mark_pool = create_mark_pool(vm->gc_threads);
+        }
+        parallel_mark(vm->mark_pool, &vm->mark_bits, vm->gray_stack, vm->gray_cnt);
+        vm->gray_cnt = 0;
+    } else {
+        trace_references(vm);
+    }
+}
+
+static void mark_sweep(vm_t* vm) {
 #ifdef __DEBUG_GC__
     assert(vm->gc_on);
     fprintf(stderr, "-- GC start --\n");
 #endif
-    mark_roots(vm);
-    trace_references(vm);
-    sweep(vm);
+    finish_background_sweep(vm);
+    uint64_t start = now_ns();
+    mark_heap(vm);
+    // When the collection starts with the heap full, the next allocation would
+    // wait for the sweeper right away and nothing would overlap.
+    if (vm->concurrent_sweep && vm->gc_target_ratio != 0
+            && heap_available() >= heap_capacity() / SWEEP_MIN_HEADROOM) {
+        start_background_sweep(vm);
+    } else {
+        sweep(vm);
+        heap_release_pages();
+        update_trigger(vm);
+    }
+    vm->major_collections += 1;
+    record_pause(vm, now_ns() - start);
 #ifdef __DEBUG_GC__
     fprintf(stderr, "-- GC end --\n");
 #endif
 }
 
+/* ============= MARK-COMPACT =============== */
+
+static void forward_val(value_t* val) {
+    if (IS_OBJ(*val)) {
+        *val = OBJ_VAL((obj_t*)heap_forward(AS_OBJ(*val)));
+    }
+}
+
+/// Forwards keys and values of the table, not the entries themselves.
+static void forward_table(hash_map_t* table) {
+    for (size_t i = 0; i < table->capacity; ++i) {
+        entry_t* entry = &table->entries[i];
+        if (entry->key != NULL) {
+            entry->key = heap_forward(entry->key);
+            forward_val(&entry->value);
+        }
+    }
+}
+
+/// Rewrites the references inside the object to the addresses they get by the compaction.
+static void forward_fields(obj_t* obj) {
+    switch (obj->type) {
+        case OBJ_INSTANCE: {
+            obj_instance_t* instance = (obj_instance_t*)obj;
+            forward_val(&instance->extends);
+            for (size_t i = 0; i < instance->class->size; ++i) {
+                forward_val(&instance->fields[i]);
+            }
+            instance->class = heap_forward(instance->class);
+            break;
+        }
+        case OBJ_ARRAY: {
+            obj_array_t* arr = (obj_array_t*)obj;
+            for (size_t i = 0; i < arr->size; ++i) {
+                forward_val(&arr->values[i]);
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            obj_class_t* class = (obj_class_t*)obj;
+            for (size_t i = 0; i < class->size; ++i) {
+                class->fields[i] = heap_forward(class->fields[i]);
+            }
+            // Method table lives on the heap too
+            forward_table(&class->methods);
+            class->methods.entries = heap_forward(class->methods.entries);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/// Forwards objects referenced by the pre-decoded instructions and their inline caches.
+static void forward_code(chunk_t* chunk) {
+    for (size_t i = 0; i < chunk->code_size; ++i) {
+        instruction_t* ins = &chunk->code[i];
+        switch (ins->opcode) {
+            case OP_LITERAL:
+            case OP_PRINT:
+            case OP_OBJECT:
+                forward_val(&ins->value);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_CALL_FUNCTION:
+                ins->name = heap_forward(ins->name);
+                break;
+            case OP_GET_FIELD:
+            case OP_SET_FIELD:
+                ins->name = heap_forward(ins->name);
+                for (size_t j = 0; j < ins->field_cache->count; ++j) {
+                    ins->field_cache->entries[j].class = heap_forward(ins->field_cache->entries[j].class);
+                }
+                break;
+            default:
+                // Method call, possibly specialized for the builtin types
+                if (ins->opcode == OP_CALL_METHOD || ins->opcode >= OP_ADD_INT) {
+                    ins->name = heap_forward(ins->name);
+                    for (size_t j = 0; j < ins->cache->count; ++j) {
+                        for (size_t k = 0; k <= ins->cache->entries[j].depth; ++k) {
+                            ins->cache->entries[j].path[k] = heap_forward(ins->cache->entries[j].path[k]);
+                        }
+                        ins->cache->entries[j].method = heap_forward(ins->cache->entries[j].method);
+                    }
+                }
+                break;
+        }
+    }
+}
+
+#ifdef __DEBUG__
+/// Every heap block has to be owned by an object or by the chunk, otherwise a reference
+/// to it would not be forwarded.
+static void check_heap_owners(vm_t* vm) {
+    size_t blocks = (vm->bytecode.pool.data != NULL) + (vm->bytecode.globals.indexes != NULL);
+    for (obj_t* obj = vm->objects; obj != NULL; obj = obj->next) {
+        blocks += 1;
+        if (obj->type == OBJ_CLASS && ((obj_class_t*)obj)->methods.entries != NULL) {
+            blocks += 1;
+        }
+    }
+    assert(blocks == heap_done());
+}
+#endif
+
+/**
+ * Compacting full collection. After the marking and sweeping, the live blocks are
+ * slid towards the start of the heap (Lisp 2 style): their new addresses are computed
+ * first, then all the references are rewritten, then the blocks are moved.
+ */
+static void mark_compact(vm_t* vm) {
+    uint64_t start = now_ns();
+    mark_heap(vm);
+    sweep(vm);
+#ifdef __DEBUG__
+    check_heap_owners(vm);
+#endif
+    heap_plan_compaction();
+
+    for (size_t i = 0; i < vm->op_stack.size; ++i) {
+        forward_val(&vm->op_stack.data[i]);
+    }
+    for (size_t i = 0; i < vm->globals_count; ++i) {
+        forward_val(&vm->globals[i]);
+    }
+    forward_table(&vm->global_var);
+    forward_table(&vm->strings);
+    constant_pool_t* pool = &vm->bytecode.pool;
+    for (size_t i = 0; i < pool->len; ++i) {
+        forward_val(&pool->data[i]);
+    }
+    pool->data = heap_forward(pool->data);
+    vm->bytecode.globals.indexes = heap_forward(vm->bytecode.globals.indexes);
+    forward_code(&vm->bytecode);
+    vm->entry = heap_forward(vm->entry);
+
+    // The objects are still in place, so the list can be walked
+    for (obj_t* obj = vm->objects; obj != NULL;) {
+        obj_t* next = obj->next;
+        forward_fields(obj);
+        obj->next = heap_forward(next);
+        obj = next;
+    }
+    vm->objects = heap_forward(vm->objects);
+
+    heap_compact();
+    heap_release_pages();
+    update_trigger(vm);
+    vm->major_collections += 1;
+    record_pause(vm, now_ns() - start);
+}
+
+/* ============= INCREMENTAL GC =============== */
+
+// Work done by a slice per allocated byte, higher values make the cycles shorter.
+#define GC_STEP_MULTIPLIER 2
+#ifdef __STRESS_GC__
+// Run slice on every allocation
+#define GC_STEP_SIZE 1
+#else
+// Allocated bytes between two slices.
+#define GC_STEP_SIZE (64 * 1024)
+#endif
+// Number of objects processed between checks of the pause budget.
+#define GC_CLOCK_CHECK_INTERVAL 64
+
+static void start_cycle(vm_t* vm) {
+    finish_background_sweep(vm);
+    vm->gc_phase = GC_MARKING;
+    reserve_mark_bitmap(&vm->mark_bits);
+    mark_roots(vm);
+}
+
+/// Roots are written without barrier, so they are marked again at the end of marking
+/// and the marking is finished without interruption. Then the sweeping can start,
+/// the object list is detached and objects allocated from now on are white.
+static void finish_marking(vm_t* vm) {
+    mark_roots(vm);
+    trace_references(vm);
+    vm->gc_phase = GC_SWEEPING;
+    vm->sweep_cursor = vm->objects;
+    vm->objects = NULL;
+    vm->sweep_survivors = NULL;
+    vm->sweep_survivors_tail = NULL;
+}
+
+static void finish_sweeping(vm_t* vm) {
+    // Survivors are put before the objects allocated during the sweep
+    if (vm->sweep_survivors != NULL) {
+        vm->sweep_survivors_tail->next = vm->objects;
+        vm->objects = vm->sweep_survivors;
+    }
+    vm->sweep_survivors = vm->sweep_survivors_tail = NULL;
+    clear_mark_bitmap(&vm->mark_bits);
+    heap_release_pages();
+    vm->gc_phase = GC_IDLE;
+    vm->major_collections += 1;
+    update_trigger(vm);
+    heap_log('G');
+}
+
+/// Sweeps single object.
+/// @return Size of the object.
+static size_t sweep_step(vm_t* vm) {
+    obj_t* obj = vm->sweep_cursor;
+    vm->sweep_cursor = obj->next;
+    size_t size = object_size(obj);
+    if (is_marked(&vm->mark_bits, obj)) {
+        obj->next = NULL;
+        if (vm->sweep_survivors_tail == NULL) {
+            vm->sweep_survivors = obj;
+        } else {
+            vm->sweep_survivors_tail->next = obj;
+        }
+        vm->sweep_survivors_tail = obj;
+    } else {
+        free_object(obj);
+    }
+    return size;
+}
+
+/**
+ * Does a slice of the incremental GC work. The amount of work is proportional to the
+ * allocated bytes, the slice also stops when it exceeds the pause budget.
+ */
+static void gc_slice(vm_t* vm) {
+    uint64_t start = now_ns();
+    uint64_t deadline = start + vm->gc_pause_budget * 1000;
+    size_t budget = vm->gc_debt * GC_STEP_MULTIPLIER;
+    vm->gc_debt = 0;
+
+    if (vm->gc_phase == GC_IDLE) {
+        start_cycle(vm);
+    }
+    for (size_t work = 0, steps = 0; work < budget; ++ steps) {
+        if (steps % GC_CLOCK_CHECK_INTERVAL == 0 && steps != 0 && now_ns() > deadline) {
+            break;
+        }
+        if (vm->gc_phase == GC_MARKING) {
+            if (vm->gray_cnt == 0) {
+                finish_marking(vm);
+                continue;
+            }
+            obj_t* obj = vm->gray_stack[--vm->gray_cnt];
+            blacken(obj, vm);
+            work += object_size(obj);
+        } else {
+            if (vm->sweep_cursor == NULL) {
+                finish_sweeping(vm);
+                break;
+            }
+            work += sweep_step(vm);
+        }
+    }
+    record_pause(vm, now_ns() - start);
+}
+
+/// Pays the allocation debt, starts new cycle if the heap usage reached the threshold.
+static void gc_step(vm_t* vm, size_t size) {
+#ifndef __STRESS_GC__
+    if (vm->gc_phase == GC_IDLE && !gc_due(vm)) {
+        return;
+    }
+#endif
+    vm->gc_debt += size;
+    if (vm->gc_debt >= GC_STEP_SIZE) {
+        gc_slice(vm);
+    }
+}
+
+/// Finishes the current incremental cycle without interruption.
+static void finish_cycle(vm_t* vm) {
+    uint64_t start = now_ns();
+    if (vm->gc_phase == GC_MARKING) {
+        trace_references(vm);
+        finish_marking(vm);
+    }
+    while (vm->sweep_cursor != NULL) {
+        sweep_step(vm);
+    }
+    if (vm->gc_phase == GC_SWEEPING) {
+        finish_sweeping(vm);
+    }
+    record_pause(vm, now_ns() - start);
+}
+
+void run_gc(vm_t* vm) {
+    // Full collection, empty the nursery first so that
+    // only the old generation has to be swept.
+    if (vm->gc_mode == GC_GENERATIONAL) {
+        collect_nursery(vm);
+    }
+    // The objects allocated during the marking survived the finished cycle,
+    // collect again if the cycle didn't start from the beginning.
+    if (vm->gc_phase != GC_IDLE) {
+        bool was_marking = vm->gc_phase == GC_MARKING;
+        finish_cycle(vm);
+        if (was_marking) {
+            return;
+        }
+    }
+    if (vm->gc_mode == GC_MARK_COMPACT) {
+        mark_compact(vm);
+    } else {
+        mark_sweep(vm);
+    }
+}
+
+static void init_nursery(vm_t* vm) {
+    size_t size = vm->nursery_size;
+    // Keep most of the heap for the old generation
+    if (size > heap_available() / 8) {
+        size = heap_available() / 8;
+    }
+    size &= ~(size_t)(NURSERY_ALIGNMENT - 1);
+    vm->nursery_start = aligned_alloc(NURSERY_ALIGNMENT, size);
+    if (vm->nursery_start == NULL) {
+        fprintf(stderr, "Failed to allocate the nursery.\n");
+        exit(11);
+    }
+    vm->nursery_top = vm->nursery_start;
+    vm->nursery_end = vm->nursery_start + size;
+}
+
+void free_gc(vm_t* vm) {
+    finish_background_sweep(vm);
+    release_bump_regions(vm);
+    // Return the objects which are being swept to the object list, so they are freed with the rest
+    if (vm->gc_phase == GC_SWEEPING) {
+        if (vm->sweep_survivors != NULL) {
+            vm->sweep_survivors_tail->next = vm->objects;
+            vm->objects = vm->sweep_survivors;
+        }
+        while (vm->sweep_cursor != NULL) {
+            obj_t* next = vm->sweep_cursor->next;
+            vm->sweep_cursor->next = vm->objects;
+            vm->objects = vm->sweep_cursor;
+            vm->sweep_cursor = next;
+        }
+    }
+    vm->gc_phase = GC_IDLE;
+    vm->gray_cnt = 0;
+    free(vm->pauses);
+    vm->pauses = NULL;
+    vm->pauses_cnt = vm->pauses_capacity = 0;
+    free(vm->nursery_start);
+    free(vm->remembered);
+    vm->nursery_start = vm->nursery_top = vm->nursery_end = NULL;
+    vm->remembered = NULL;
+    vm->remembered_cnt = vm->remembered_capacity = 0;
+    if (vm->mark_pool != NULL) {
+        free_mark_pool(vm->mark_pool);
+        vm->mark_pool = NULL;
+    }
+}
+
+/// Empties the nursery, collects the whole heap if the old generation
+/// could not hold the next promotion.
+static void minor_gc(vm_t* vm) {
+    collect_nursery(vm);
+    if (heap_available() < promotion_reserve(vm)
+            && (!finish_background_sweep(vm) || heap_available() < promotion_reserve(vm))) {
+        mark_sweep(vm);
+        heap_log('G');
+    } else if (gc_due(vm)) {
+        // The old generation grew by the target ratio
+        mark_sweep(vm);
+        heap_log('T');
+    }
+}
+
+/// Bump allocates in the nursery, runs minor collection if it is full.
+/// @return NULL if the object doesn't fit into the nursery.
+static obj_t* alloc_young(size_t size, vm_t* vm) {
+    size = (size + NURSERY_ALIGNMENT - 1) & ~(size_t)(NURSERY_ALIGNMENT - 1);
+#ifdef __STRESS_GC__
+    minor_gc(vm);
+#endif
+    if ((size_t)(vm->nursery_end - vm->nursery_top) < size) {
+        if (vm->nursery_start == NULL) {
+            init_nursery(vm);
+        } else {
+            minor_gc(vm);
+        }
+        if ((size_t)(vm->nursery_end - vm->nursery_top) < size) {
+            return NULL;
+        }
+    }
+    obj_t* obj = (obj_t*)vm->nursery_top;
+    vm->nursery_top += size;
+    return obj;
+}
+
+obj_t* alloc_obj_with_gc(size_t size, vm_t* vm) {
+    if (vm->gc_on && vm->gc_mode == GC_INCREMENTAL) {
+        gc_step(vm, size);
+    }
+    obj_t* obj = NULL;
+    if (vm->gc_on && vm->gc_mode == GC_GENERATIONAL
+            && size <= vm->nursery_size / NURSERY_LARGE_OBJECT_FRACTION) {
+        obj = alloc_young(size, vm);
+    }
+    bool young = obj != NULL;
+    if (!young) {
+        obj = alloc_with_gc(size, vm);
+    }
+    obj->forwarded = false;
+    obj->remembered = false;
+    if (!young) {
+        obj->next = vm->objects;
+        vm->objects = obj;
+        // The fields are initialized after the allocation
+        // and they can point into the nursery.
+        if (vm->gc_on && vm->gc_mode == GC_GENERATIONAL) {
+            remember_object(vm, obj);
+        }
+    }
+    // Objects allocated during the marking survive the cycle. Their fields are
+    // initialized after the allocation, so they have to be scanned (allocated gray).
+    if (vm->gc_phase == GC_MARKING) {
+        shade_object(vm, obj);
+    }
+    // The next objects of the size class are bump allocated
+    refill_bump_region(size, vm);
+    return obj;
+}
+
 void* alloc_with_gc(size_t size, vm_t* vm) {
     if (!vm->gc_on) {
         return heap_alloc(size);
@@ -159,12 +915,38 @@ void* alloc_with_gc(size_t size, vm_t* vm) {
 #ifdef __STRESS_GC__
     run_gc(vm);
 #endif
+    // Collect before the heap is full if it grew by the target ratio, the incremental
+    // GC checks the trigger by itself. The nursery is checked by minor collections.
+    if (vm->gc_mode != GC_INCREMENTAL && gc_due(vm)) {
+        run_gc(vm);
+        heap_log('T');
+    }
+    // Make sure the nursery can still be promoted
+    if (vm->gc_mode == GC_GENERATIONAL && heap_available() < 2 * size + promotion_reserve(vm)
+            && (!finish_background_sweep(vm) || heap_available() < 2 * size + promotion_reserve(vm))) {
+        run_gc(vm);
+        heap_log('G');
+    }
     void* ptr = heap_alloc(size);
+    // The memory being swept may be enough
+    if (ptr == NULL && finish_background_sweep(vm)) {
+        ptr = heap_alloc(size);
+    }
     if (ptr == NULL) {
         // Try to run gc
+        bool was_marking = vm->gc_phase == GC_MARKING;
         run_gc(vm);
         heap_log('G');
         ptr = heap_alloc(size);
+        // Finishing the incremental cycle kept the objects allocated during its marking
+        if (ptr == NULL && was_marking) {
+            mark_sweep(vm);
+            heap_log('G');
+            ptr = heap_alloc(size);
+        }
+        if (ptr == NULL && finish_background_sweep(vm)) {
+            ptr = heap_alloc(size);
+        }
         // If after the GC the allocation still failed, just die
         if (ptr == NULL) {
             fprintf(stderr, "The heap is not big enough to allocate object of size %lu\n", size);
@@ -182,9 +964,21 @@ void* realloc_with_gc(void* ptr, size_t size, vm_t* vm) {
     run_gc(vm);
 #endif
     void* ret = heap_realloc(ptr, size);
+    if (ret == NULL && size != 0 && finish_background_sweep(vm)) {
+        ret = heap_realloc(ptr, size);
+    }
     if (ret == NULL && size != 0) {
+        bool was_marking = vm->gc_phase == GC_MARKING;
         run_gc(vm);
         ret = heap_realloc(ptr, size);
+        // Finishing the incremental cycle kept the objects allocated during its marking
+        if (ret == NULL && was_marking) {
+            mark_sweep(vm);
+            ret = heap_realloc(ptr, size);
+        }
+        if (ret == NULL && finish_background_sweep(vm)) {
+            ret = heap_realloc(ptr, size);
+        }
         if (ret == NULL) {
             fprintf(stderr, "The heap is not big enough to allocate object of size %lu\n", size);
             exit(11);
@@ -198,3 +992,45 @@ void* calloc_with_gc(size_t size, size_t cnt, vm_t* vm) {
     memset(ret, 0, size * cnt);
     return ret;
 }
+
+static void* gc_alloc_fn(size_t size, void* ctx) {
+    return calloc_with_gc(size, 1, ctx);
+}
+
+static void gc_free_fn(void* ptr, size_t size, void* ctx) {
+    (void)size; (void)ctx;
+    heap_free(ptr);
+}
+
+allocator_t gc_allocator(vm_t* vm) {
+    return (allocator_t){ .alloc = gc_alloc_fn, .free = gc_free_fn, .ctx = vm };
+}
+
+static int compare_pauses(const void* x, const void* y) {
+    uint64_t a = *(const uint64_t*)x, b = *(const uint64_t*)y;
+    return (a > b) - (a < b);
+}
+
+void print_gc_stats(FILE* stream, vm_t* vm) {
+    fprintf(stream, "GC: %zu minor, %zu major collections\n", vm->minor_collections, vm->major_collections);
+    heap_class_stats_t classes[HEAP_SIZE_CLASSES];
+    heap_class_stats(classes);
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i) {
+        if (classes[i].runs > 0) {
+            fprintf(stream, "Heap class %zu B: %zu/%zu slots used in %zu runs (%.1f%%)\n",
+                    classes[i].size, classes[i].used_slots, classes[i].total_slots, classes[i].runs,
+                    100.0 * classes[i].used_slots / classes[i].total_slots);
+        }
+    }
+    if (vm->pauses_cnt == 0) {
+        return;
+    }
+    uint64_t total = 0;
+    for (size_t i = 0; i < vm->pauses_cnt; ++ i) {
+        total += vm->pauses[i];
+    }
+    qsort(vm->pauses, vm->pauses_cnt, sizeof(*vm->pauses), compare_pauses);
+    fprintf(stream, "GC pauses: %zu, total %.3f ms, mean %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            vm->pauses_cnt, total / 1e6, total / 1e6 / vm->pauses_cnt,
+            vm->pauses[vm->pauses_cnt * 99 / 100] / 1e6, vm->pauses[vm->pauses_cnt - 1] / 1e6);
+}
@@ -129,9 +129,9 @@ static void prepare_jumps(const chunk_t* chunk, hash_map_t* jump_map) {
                     exit(54);
                 }
 
-                chunk->bytecode[i + 1] = (uint8_t)(row.num >> 16);
-                chunk->bytecode[i + 2] = (uint8_t)(row.num >> 8);
-                chunk->bytecode[i + 3] = (uint8_t)row.num;
+                chunk->bytecode[i + 1] = (uint8_t)(AS_NUMBER(row) >> 16);
+                chunk->bytecode[i + 2] = (uint8_t)(AS_NUMBER(row) >> 8);
+                chunk->bytecode[i + 3] = (uint8_t)AS_NUMBER(row);
                 i += 4;
                 break;
             }
@@ -142,6 +142,304 @@ static void prepare_jumps(const chunk_t* chunk, hash_map_t* jump_map) {
     }
 }
 
+/// Returns length of the instruction in bytes, after the jumps were prepared.
+static size_t instruction_length(uint8_t opcode) {
+    switch (opcode) {
+        case OP_RETURN:
+        case OP_ARRAY:
+        case OP_DROP:
+            return 1;
+        case OP_LITERAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_LABEL:
+        case OP_OBJECT:
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+            return 3;
+        case OP_CALL_FUNCTION:
+        case OP_PRINT:
+        case OP_CALL_METHOD:
+        case OP_JUMP:
+        case OP_BRANCH:
+            return 4;
+        default:
+            fprintf(stderr, "Unknown instruction '0x%X' to pre-decode.\n", opcode);
+            exit(54);
+    }
+}
+
+static const struct {
+    const char* symbol;
+    const char* name;
+    builtin_t builtin;
+} builtins[] = {
+    {"+", "add", BUILTIN_ADD},
+    {"-", "sub", BUILTIN_SUB},
+    {"*", "mul", BUILTIN_MUL},
+    {"/", "div", BUILTIN_DIV},
+    {"%", "mod", BUILTIN_MOD},
+    {"<=", "le", BUILTIN_LE},
+    {">=", "ge", BUILTIN_GE},
+    {"<", "lt", BUILTIN_LT},
+    {">", "gt", BUILTIN_GT},
+    {"==", "eq", BUILTIN_EQ},
+    {"!=", "neq", BUILTIN_NEQ},
+    {"|", "or", BUILTIN_OR},
+    {"&", "and", BUILTIN_AND},
+    {"get", "get", BUILTIN_GET},
+    {"set", "set", BUILTIN_SET},
+};
+
+/// Resolves method name to the builtin operator it may call.
+static builtin_t resolve_builtin(const obj_string_t* name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(*builtins); ++ i) {
+        if (strcmp(name->data, builtins[i].symbol) == 0 || strcmp(name->data, builtins[i].name) == 0) {
+            return builtins[i].builtin;
+        }
+    }
+    return BUILTIN_NONE;
+}
+
+/// Returns the specialized instruction for method call, or OP_CALL_METHOD
+/// if there is none.
+static uint8_t specialize_method_call(builtin_t builtin, uint8_t arg_cnt) {
+    if (arg_cnt == 3) {
+        return builtin == BUILTIN_SET ? OP_ARRAY_SET : OP_CALL_METHOD;
+    }
+    if (arg_cnt != 2) {
+        return OP_CALL_METHOD;
+    }
+    switch (builtin) {
+        case BUILTIN_ADD: return OP_ADD_INT;
+        case BUILTIN_SUB: return OP_SUB_INT;
+        case BUILTIN_MUL: return OP_MUL_INT;
+        case BUILTIN_DIV: return OP_DIV_INT;
+        case BUILTIN_MOD: return OP_MOD_INT;
+        case BUILTIN_LT: return OP_LT_INT;
+        case BUILTIN_LE: return OP_LE_INT;
+        case BUILTIN_GT: return OP_GT_INT;
+        case BUILTIN_GE: return OP_GE_INT;
+        case BUILTIN_EQ: return OP_EQ_INT;
+        case BUILTIN_NEQ: return OP_NEQ_INT;
+        case BUILTIN_GET: return OP_ARRAY_GET;
+        default: return OP_CALL_METHOD;
+    }
+}
+
+/// Returns how the instruction changes depth of the operand stack.
+static int stack_effect(const instruction_t* ins) {
+    switch (ins->opcode) {
+        case OP_LITERAL:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+            return 1;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_FIELD:
+        case OP_JUMP:
+        case OP_RETURN:
+            return 0;
+        case OP_DROP:
+        case OP_BRANCH:
+        case OP_SET_FIELD:
+        case OP_ARRAY:
+            return -1;
+        case OP_OBJECT:
+            // Pops parent and the fields, pushes the instance.
+            return -AS_CLASS(ins->value)->size;
+        default:
+            // Print and calls pop their arguments and push the result.
+            return 1 - ins->arg_cnt;
+    }
+}
+
+/**
+ * Computes maximum depth of the operand stack the function can reach,
+ * by following all paths from its entry. The compiler produces code where
+ * the depth is the same on all paths reaching an instruction, bytecode
+ * which doesn't is rejected, as is bytecode popping from the empty stack.
+ * @param depths Depth before each instruction, -1 for not yet visited.
+ * @param worklist Buffer big enough to hold all instructions indexes.
+ */
+static uint32_t max_stack_depth(const chunk_t* chunk, size_t entry, int32_t* depths, size_t* worklist) {
+    int32_t max = 0;
+    size_t pending = 0;
+    depths[entry] = 0;
+    worklist[pending++] = entry;
+    while (pending != 0) {
+        size_t i = worklist[--pending];
+        const instruction_t* ins = &chunk->code[i];
+        int32_t depth = depths[i] + stack_effect(ins);
+        if (depth < 0) {
+            fprintf(stderr, "Instruction %zu pops from the empty operand stack.\n", i);
+            exit(54);
+        }
+        if (depth > max) {
+            max = depth;
+        }
+        if (ins->opcode == OP_RETURN) {
+            continue;
+        }
+        size_t next[2];
+        size_t next_cnt = 0;
+        if (ins->opcode == OP_JUMP || ins->opcode == OP_BRANCH) {
+            next[next_cnt++] = ins->target - chunk->code;
+        }
+        if (ins->opcode != OP_JUMP) {
+            next[next_cnt++] = i + 1;
+        }
+        for (size_t j = 0; j < next_cnt; ++ j) {
+            if (depths[next[j]] == -1) {
+                depths[next[j]] = depth;
+                worklist[pending++] = next[j];
+            } else if (depths[next[j]] != depth) {
+                fprintf(stderr, "Operand stack depth %d differs from %d on another path to instruction %zu.\n",
+                        depth, depths[next[j]], next[j]);
+                exit(54);
+            }
+        }
+    }
+    return max;
+}
+
+/// Returns slot of the global variable. Globals which weren't declared
+/// get a new slot initialized to null.
+static uint32_t global_slot(vm_t* vm, obj_string_t* name) {
+    value_t slot;
+    if (hash_map_fetch(&vm->global_var, name, &slot)) {
+        return AS_NUMBER(slot);
+    }
+    return add_global(vm, name, NULL_VAL);
+}
+
+/**
+ * Translates the bytecode into array of pre-decoded instructions.
+ * Constant pool indexes are replaced with the constants themselves, global
+ * names with their slots and jumps with pointers to their destination. Labels are dropped, jumps to them
+ * point to the instruction following the label.
+ * Has to be called after the jumps were prepared.
+ */
+static void predecode(vm_t* vm) {
+    chunk_t* chunk = &vm->bytecode;
+    // Maps offset in the bytecode to index of pre-decoded instruction.
+    uint32_t* offsets = malloc(chunk->size * sizeof(*offsets));
+    size_t count = 0;
+    for (size_t i = 0; i < chunk->size; i += instruction_length(chunk->bytecode[i])) {
+        offsets[i] = count;
+        if (chunk->bytecode[i] != OP_LABEL) {
+            count += 1;
+        }
+    }
+
+    size_t bytes = count * sizeof(*chunk->code);
+    bytes = (bytes + CODE_ALIGNMENT - 1) / CODE_ALIGNMENT * CODE_ALIGNMENT;
+    instruction_t* code = aligned_alloc(CODE_ALIGNMENT, bytes);
+    if (code == NULL) {
+        fprintf(stderr, "Not enough memory to pre-decode bytecode.\n");
+        exit(1);
+    }
+    memset(code, 0, bytes);
+
+    size_t call_sites = 0;
+    size_t field_sites = 0;
+    for (size_t i = 0; i < chunk->size; i += instruction_length(chunk->bytecode[i])) {
+        call_sites += chunk->bytecode[i] == OP_CALL_METHOD;
+        field_sites += chunk->bytecode[i] == OP_GET_FIELD || chunk->bytecode[i] == OP_SET_FIELD;
+    }
+    method_cache_t* caches = calloc(call_sites, sizeof(*caches));
+    field_cache_t* field_caches = calloc(field_sites, sizeof(*field_caches));
+    call_sites = 0;
+    field_sites = 0;
+
+    for (size_t i = 0; i < chunk->size; i += instruction_length(chunk->bytecode[i])) {
+        uint8_t* ins = chunk->bytecode + i;
+        instruction_t* dest = &code[offsets[i]];
+        if (*ins == OP_LABEL) {
+            continue;
+        }
+        dest->opcode = *ins;
+        dest->offset = i;
+        switch (*ins) {
+            case OP_LITERAL:
+                dest->value = chunk->pool.data[READ_2BYTES(ins + 1)];
+                break;
+            case OP_PRINT:
+                dest->value = chunk->pool.data[READ_2BYTES(ins + 1)];
+                dest->arg_cnt = READ_BYTE(ins + 3);
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                dest->index = READ_2BYTES(ins + 1);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+                dest->name = AS_STRING(chunk->pool.data[READ_2BYTES(ins + 1)]);
+                dest->slot = global_slot(vm, dest->name);
+                break;
+            case OP_GET_FIELD:
+            case OP_SET_FIELD:
+                dest->name = AS_STRING(chunk->pool.data[READ_2BYTES(ins + 1)]);
+                dest->field_cache = &field_caches[field_sites++];
+                break;
+            case OP_OBJECT:
+                dest->value = chunk->pool.data[READ_2BYTES(ins + 1)];
+                break;
+            case OP_CALL_METHOD:
+                dest->cache = &caches[call_sites++];
+                dest->builtin = resolve_builtin(AS_STRING(chunk->pool.data[READ_2BYTES(ins + 1)]));
+                dest->opcode = specialize_method_call(dest->builtin, READ_BYTE(ins + 3));
+                dest->name = AS_STRING(chunk->pool.data[READ_2BYTES(ins + 1)]);
+                dest->arg_cnt = READ_BYTE(ins + 3);
+                break;
+            case OP_CALL_FUNCTION:
+                dest->name = AS_STRING(chunk->pool.data[READ_2BYTES(ins + 1)]);
+                dest->slot = global_slot(vm, dest->name);
+                dest->arg_cnt = READ_BYTE(ins + 3);
+                break;
+            case OP_JUMP:
+            case OP_BRANCH: {
+                // Jump index is not in little endian.
+                size_t target = ins[1] << 16 | ins[2] << 8 | ins[3];
+                dest->target = &code[offsets[target]];
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    chunk->code = code;
+    chunk->code_size = count;
+    chunk->caches = caches;
+    chunk->field_caches = field_caches;
+
+    // Functions are entered through the pre-decoded instructions
+    for (size_t i = 0; i < chunk->pool.len; ++ i) {
+        if (IS_FUNCTION(chunk->pool.data[i])) {
+            obj_function_t* fun = AS_FUNCTION(chunk->pool.data[i]);
+            fun->code_entry = offsets[fun->entry_point];
+        }
+    }
+    free(offsets);
+
+    int32_t* depths = malloc(count * sizeof(*depths));
+    size_t* worklist = malloc(count * sizeof(*worklist));
+    for (size_t i = 0; i < count; ++ i) {
+        depths[i] = -1;
+    }
+    for (size_t i = 0; i < chunk->pool.len; ++ i) {
+        if (IS_FUNCTION(chunk->pool.data[i])) {
+            obj_function_t* fun = AS_FUNCTION(chunk->pool.data[i]);
+            fun->max_stack = max_stack_depth(chunk, fun->code_entry, depths, worklist);
+        }
+    }
+    free(depths);
+    free(worklist);
+}
+
 /// Parses 'intruction_count' instruciton from 'bytecode'.
 /// @return Returns pair containing number of bytes read and size
 ///         of the new instructions stored (jumps are smaller when not parsed)
@@ -225,8 +523,11 @@ static uint8_t* parse_constant_pool(vm_t* vm, uint8_t *file) {
     chunk_t* chunk = &vm->bytecode;
     uint16_t size = READ_2BYTES(file);
     file += 2;
+    // Labels are needed only for the parsing
+    arena_t labels_arena;
+    init_arena(&labels_arena);
     hash_map_t labels;
-    init_hash_map(&labels);
+    init_hash_map(&labels, arena_allocator(&labels_arena));
 
     globals_pending_t pending;
     init_pending(&pending);
@@ -248,7 +549,7 @@ static uint8_t* parse_constant_pool(vm_t* vm, uint8_t *file) {
             case CD_STRING: {
                 size_t length = READ_4BYTES(file + 1);
                 const char* str = (char*)(file + 5);
-                add_constant(&chunk->pool, OBJ_STRING_VAL(length, str, hash_string(str), vm));
+                add_constant(&chunk->pool, OBJ_INTERNED_STRING_VAL(length, str, hash_bytes(str, length), vm));
                 file += 5 + length;
                 break;
             }
@@ -318,9 +619,9 @@ static uint8_t* parse_constant_pool(vm_t* vm, uint8_t *file) {
     for (size_t i = 0; i < pending.size; ++i) {
         value_t val = chunk->pool.data[pending.data[i]];
         if (IS_SLOT(val)) {
-            hash_map_insert(&vm->global_var, AS_STRING(chunk->pool.data[AS_SLOT(val)->index]), NULL_VAL);
+            add_global(vm, AS_STRING(chunk->pool.data[AS_SLOT(val)->index]), NULL_VAL);
         } else if (IS_FUNCTION(val)) {
-            hash_map_insert(&vm->global_var, AS_STRING(chunk->pool.data[AS_FUNCTION(val)->name]), val);
+            add_global(vm, AS_STRING(chunk->pool.data[AS_FUNCTION(val)->name]), val);
         } else {
             fprintf(stderr, "Unknown object in globals pending.\n");
             dissasemble_value(stderr, val);
@@ -329,7 +630,9 @@ static uint8_t* parse_constant_pool(vm_t* vm, uint8_t *file) {
         }
     }
 
+    free(pending.data);
     free_hash_map(&labels);
+    free_arena(&labels_arena);
     return file;
 }
 
@@ -353,10 +656,15 @@ void parse(vm_t* vm, const char* name) {
     file_ptr = parse_constant_pool(vm, file_ptr);
 
     file_ptr = parse_globals(vm, file_ptr);
+    // Terminate the bytecode, so the interpreter doesn't have to
+    // check bounds of the instruction pointer.
+    write_chunk(&vm->bytecode, OP_RETURN);
+    predecode(vm);
     // Read entry point
     uint16_t entry_point = READ_2BYTES(file_ptr);
 
-    vm->ip = &vm->bytecode.bytecode[AS_FUNCTION((vm->bytecode.pool.data[entry_point]))->entry_point];
+    vm->entry = AS_FUNCTION(vm->bytecode.pool.data[entry_point]);
+    vm->ip = &vm->bytecode.code[vm->entry->code_entry];
     free(file);
     vm->gc_on = true;
 }
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "include/constant.h"
@@ -18,23 +19,47 @@ call_frame_t* get_global_frame(call_frames_t* call_frames) {
     return &call_frames->frames[0];
 }
 
-void push_frame(vm_t* vm, uint8_t* ip) {
+bool push_frame(vm_t* vm, instruction_t* ip, obj_function_t* func, uint8_t arg_cnt) {
     call_frames_t* call_frames = &vm->frames;
     if (call_frames->length >= call_frames->capacity) {
         call_frames->capacity = NEW_CAPACITY(call_frames->capacity);
         call_frames->frames = realloc(call_frames->frames, sizeof(*call_frames->frames) * call_frames->capacity);
     }
 
-    for(size_t i = 0; i < MAX_LOCALS; ++ i) {
-        call_frames->frames[call_frames->length].locals_vector[i] = NULL_VAL;
+    op_stack_t* stack = &vm->op_stack;
+    size_t base = stack->size - arg_cnt;
+    size_t frame_size = func->args + func->locals;
+    if (frame_size < arg_cnt) {
+        frame_size = arg_cnt;
+    }
+    // The only overflow check for the whole frame, the operand stack of
+    // the function can't grow over max_stack.
+    if (base + frame_size + func->max_stack > stack->capacity) {
+        fprintf(stderr, "Stack overflow, the stack size is %zu values.\n", stack->capacity);
+        return false;
+    }
+
+    // Arguments are already in place, only the local variables need to be initialized
+    for (size_t i = stack->size; i < base + frame_size; ++ i) {
+        stack->data[i] = NULL_VAL;
     }
+    stack->size = base + frame_size;
 
+    call_frames->frames[call_frames->length].locals_base = base;
     call_frames->frames[call_frames->length].ip_backup = ip;
     call_frames->length += 1;
+    return true;
+}
+
+instruction_t* pop_frame(vm_t* vm) {
+    call_frame_t* frame = &vm->frames.frames[--vm->frames.length];
+    vm->op_stack.size = frame->locals_base;
+    return frame->ip_backup;
 }
 
-uint8_t* pop_frame(call_frames_t* call_frames) {
-    return call_frames->frames[--call_frames->length].ip_backup;
+/// Returns the local variables of the top frame.
+static value_t* get_locals(vm_t* vm) {
+    return vm->op_stack.data + get_top_frame(&vm->frames)->locals_base;
 }
 
 void init_frames(call_frames_t* call_frames)
@@ -55,6 +80,18 @@ void init_stack(op_stack_t* stack)
     stack->data = NULL;
 }
 
+void reserve_stack(op_stack_t* stack, size_t capacity)
+{
+    if (stack->capacity < capacity) {
+        stack->capacity = capacity;
+        stack->data = realloc(stack->data, stack->capacity * sizeof(*stack->data));
+        if (stack->data == NULL) {
+            fprintf(stderr, "Not enough memory for stack of size %zu.\n", capacity);
+            exit(1);
+        }
+    }
+}
+
 void free_stack(op_stack_t* stack)
 {
     free(stack->data);
@@ -63,11 +100,10 @@ void free_stack(op_stack_t* stack)
 void push(vm_t* vm, value_t c)
 {
     op_stack_t* stack = &vm->op_stack;
-    if (stack->size >= stack->capacity) {
-        stack->capacity = NEW_CAPACITY(stack->capacity);
-        stack->data = realloc(stack->data, stack->capacity * sizeof(*stack->data));
-    }
-
+    // Capacity is checked once per call frame, see push_frame.
+#ifdef __DEBUG__
+    assert(stack->size < stack->capacity);
+#endif
     stack->data[stack->size++] = c;
 }
 
@@ -87,11 +123,43 @@ value_t peek(op_stack_t* stack, size_t i) {
 void init_vm(vm_t* vm) {
     vm->ip = NULL;
     vm->objects = NULL;
+    vm->method_cache_hits = 0;
+    vm->method_cache_misses = 0;
     init_stack(&vm->op_stack);
+    vm->stack_size = DEFAULT_STACK_SIZE;
+    vm->entry = NULL;
     init_chunk(&vm->bytecode);
     init_frames(&vm->frames);
-    init_hash_map(&vm->global_var);
+    init_arena(&vm->arena);
+    init_hash_map(&vm->global_var, arena_allocator(&vm->arena));
+    init_hash_map(&vm->strings, arena_allocator(&vm->arena));
+    vm->globals = NULL;
+    vm->globals_count = 0;
+    vm->globals_capacity = 0;
     vm->gc_on = true;
+    vm->gc_mode = GC_MARK_SWEEP;
+    vm->nursery_size = DEFAULT_NURSERY_SIZE;
+    vm->nursery_start = vm->nursery_top = vm->nursery_end = NULL;
+    vm->remembered = NULL;
+    vm->remembered_cnt = vm->remembered_capacity = 0;
+    vm->minor_collections = 0;
+    vm->major_collections = 0;
+    vm->gc_target_ratio = 0;
+    vm->gc_threads = 1;
+    vm->mark_pool = NULL;
+    init_mark_bitmap(&vm->mark_bits);
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i) {
+        vm->bump[i] = (bump_region_t){ NULL, NULL, heap_class_size(i) };
+    }
+    vm->concurrent_sweep = false;
+    vm->sweeper_running = false;
+    vm->background_list = vm->background_tail = NULL;
+    vm->gc_phase = GC_IDLE;
+    vm->gc_debt = 0;
+    vm->gc_pause_budget = DEFAULT_GC_PAUSE_BUDGET;
+    vm->sweep_cursor = vm->sweep_survivors = vm->sweep_survivors_tail = NULL;
+    vm->pauses = NULL;
+    vm->pauses_cnt = vm->pauses_capacity = 0;
     vm->gray_capacity = 0;
     vm->gray_cnt = 0;
     vm->gray_stack = NULL;
@@ -101,21 +169,51 @@ void free_vm(vm_t* vm) {
     free_stack(&vm->op_stack);
     free_chunk(&vm->bytecode);
     free_hash_map(&vm->global_var);
+    free_hash_map(&vm->strings);
+    free_arena(&vm->arena);
+    free(vm->globals);
+
     free_frames(&vm->frames);
+    free_gc(vm);
+
+    // Free all the objects, including the ones in constant pool
+    while (vm->objects != NULL) {
+        obj_t* next = vm->objects->next;
+        free_object(vm->objects);
+        vm->objects = next;
+    }
 
     // Use the system free function, not the heap_free for GC.
     free(vm->gray_stack);
+    free_mark_bitmap(&vm->mark_bits);
     init_vm(vm);
 }
 
-int compare_str_pointers(const void* x, const void* y) {
-    const obj_string_t* str1 = *(const obj_string_t**)x;
-    const obj_string_t* str2 = *(const obj_string_t**)y;
+uint32_t add_global(vm_t* vm, obj_string_t* name, value_t value) {
+    value_t slot;
+    if (hash_map_fetch(&vm->global_var, name, &slot)) {
+        vm->globals[AS_NUMBER(slot)] = value;
+        return AS_NUMBER(slot);
+    }
+
+    if (vm->globals_count >= vm->globals_capacity) {
+        vm->globals_capacity = NEW_CAPACITY(vm->globals_capacity);
+        vm->globals = realloc(vm->globals, vm->globals_capacity * sizeof(*vm->globals));
+    }
+    vm->globals[vm->globals_count] = value;
+    hash_map_insert(&vm->global_var, name, INTEGER_VAL(vm->globals_count));
+    return vm->globals_count++;
+}
+
+/// Compares pointers to class fields names.
+int compare_field_pointers(const void* x, const void* y) {
+    const obj_string_t* str1 = **(obj_string_t* const* const*)x;
+    const obj_string_t* str2 = **(obj_string_t* const* const*)y;
     return strcmp( str1->data, str2->data );
 }
 
 bool print_value(value_t val, vm_t* vm) {
-    switch (val.type) {
+    switch (VALUE_TYPE(val)) {
         case TYPE_INTEGER:
             printf("%d", AS_NUMBER(val));
             break;
@@ -126,7 +224,7 @@ bool print_value(value_t val, vm_t* vm) {
             printf(AS_BOOL(val) ? "true" : "false");
             break;
         case TYPE_OBJECT: {
-            switch (val.obj->type) {
+            switch (OBJ_TYPE(val)) {
                 case OBJ_ARRAY: {
                     obj_array_t* array = AS_ARRAY(val);
                     printf("[");
@@ -142,12 +240,14 @@ bool print_value(value_t val, vm_t* vm) {
                 case OBJ_INSTANCE: {
                     vm->gc_on = false;
                     obj_instance_t* instance = AS_INSTANCE(val);
-                    // Fields have to be printed in lexicographical order.
-                    obj_string_t** fields = alloc_with_gc(instance->class->size * sizeof(*fields), vm);
+                    // Fields have to be printed in lexicographical order. Sort pointers
+                    // to the class fields, so the index of the value can be recovered.
+                    obj_string_t** class_fields = instance->class->fields;
+                    obj_string_t*** fields = alloc_with_gc(instance->class->size * sizeof(*fields), vm);
                     for (size_t i = 0; i < instance->class->size; ++ i) {
-                        fields[i] = instance->class->fields[i];
+                        fields[i] = &class_fields[i];
                     }
-                    qsort(fields, instance->class->size, sizeof(*fields), compare_str_pointers);
+                    qsort(fields, instance->class->size, sizeof(*fields), compare_field_pointers);
                     printf("object(");
                     if (!IS_NULL(instance->extends)) {
                         printf("..=");
@@ -157,15 +257,14 @@ bool print_value(value_t val, vm_t* vm) {
                         }
                     }
                     for (size_t i = 0; i < instance->class->size; ++ i) {
-                        value_t val;
-                        hash_map_fetch(&instance->fields, fields[i], &val);
-                        printf("%s=", fields[i]->data);
-                        print_value(val, vm);
+                        printf("%s=", (*fields[i])->data);
+                        print_value(instance->fields[fields[i] - class_fields], vm);
                         if (i != instance->class->size - 1) {
                             printf(", ");
                         }
                     }
                     printf(")");
+                    heap_free(fields);
                     vm->gc_on = true;
                     break;
                 }
@@ -182,18 +281,14 @@ bool print_value(value_t val, vm_t* vm) {
     return true;
 }
 
-#define READ_BYTE_IP(vm) (*((vm)->ip++))
-#define READ_WORD_IP(vm) ((vm)->ip += 2, (*((vm)->ip - 2) | (*((vm)->ip - 1) << 8)))
-
-bool interpret_print(vm_t* vm) {
+bool interpret_print(vm_t* vm, value_t obj, uint8_t arg_cnt) {
     // For some great reason the first popped value should be printed last.
-    value_t obj = vm->bytecode.pool.data[READ_WORD_IP(vm)];
     if (!IS_STRING(obj)) {
         fprintf(stderr, "Print keyword accepts only string as it's first argument.\n");
         return false;
     }
     const char* str = AS_CSTRING(obj);
-    int16_t index = READ_BYTE_IP(vm);
+    int16_t index = arg_cnt;
     vm->op_stack.size -= index;
     int16_t i = 0;
     for(const char* ptr = str; *ptr != '\0'; ptr ++) {
@@ -247,26 +342,20 @@ interpret_result_t interpret_function_call(vm_t* vm, obj_function_t *func, uint8
 #ifdef __DEBUG__
     assert(func != NULL && func->obj.type == OBJ_FUNCTION);
 #endif
-    push_frame(vm, vm->ip);
-    // Populate the new frame with arguments
-    call_frame_t* top_frame = get_top_frame(&vm->frames);
-    // Function arguments are popped in reverse
-    for (int i = arg_cnt - 1; i >= 0; -- i) {
-        top_frame->locals_vector[i] = pop(&vm->op_stack);
+    // Arguments on top of the stack become the first local variables
+    if (!push_frame(vm, vm->ip, func, arg_cnt)) {
+        return INTERPRET_RUNTIME_ERROR;
     }
 
     // Set instruction pointer to function entry point.
-    vm->ip = &vm->bytecode.bytecode[func->entry_point];
+    vm->ip = &vm->bytecode.code[func->code_entry];
 
     return INTERPRET_OK;
 }
 
-obj_function_t* get_function(obj_string_t* name, vm_t* vm) {
-    value_t fun;
-    if (!hash_map_fetch(&vm->global_var, name, &fun)) {
-        printf("Function '%s' does not exist.\n", name->data);
-        exit(39);
-    }
+obj_function_t* get_function(const instruction_t* ins, vm_t* vm) {
+    value_t fun = vm->globals[ins->slot];
+    obj_string_t* name = ins->name;
     if (!IS_FUNCTION(fun)) {
         printf("'%s' is not a function object, it is ", name->data);
         dissasemble_value(stdout, fun);
@@ -278,263 +367,469 @@ obj_function_t* get_function(obj_string_t* name, vm_t* vm) {
 
 /// Dispatches builtin operator methods.
 /// This is very hacky implementation, also type checking is not done most of the time.
-value_t dispatch_builtin(obj_string_t* method_name, value_t receiver, value_t right_side, value_t right_right_side) {
-#define CMP(x, y, z) (strcmp(x, y) == 0 || strcmp(x, z) == 0)
+value_t dispatch_builtin(builtin_t op, obj_string_t* method_name, value_t receiver, value_t right_side, value_t right_right_side) {
     if (IS_NUMBER(receiver)) {
-        if (CMP(method_name->data, "+", "add")) {
-            return INTEGER_VAL(receiver.num + right_side.num);
-        } else if (CMP(method_name->data, "-", "sub")) {
-            return INTEGER_VAL(receiver.num - right_side.num);
-        } else if (CMP(method_name->data, "*", "mul")) {
-            return INTEGER_VAL(receiver.num * right_side.num);
-        } else if (CMP(method_name->data, "/", "div")) {
-            return INTEGER_VAL(receiver.num / right_side.num);
-        } else if (CMP(method_name->data, "%", "mod")) {
-            return INTEGER_VAL(receiver.num % right_side.num);
-        } else if (CMP(method_name->data, "<=", "le")) {
-            return BOOL_VAL(IS_NUMBER(right_side) && receiver.num <= right_side.num);
-        } else if (CMP(method_name->data, ">=", "ge")) {
-            return BOOL_VAL(IS_NUMBER(right_side) && receiver.num >= right_side.num);
-        } else if (CMP(method_name->data, "<", "lt")) {
-            return BOOL_VAL(IS_NUMBER(right_side) && receiver.num < right_side.num);
-        } else if (CMP(method_name->data, ">","gt")) {
-            return BOOL_VAL(IS_NUMBER(right_side) && receiver.num > right_side.num);
-        } else if (CMP(method_name->data, "==", "eq")) {
-            return BOOL_VAL(IS_NUMBER(right_side) && receiver.num == right_side.num);
-        } else if (CMP(method_name->data, "!=", "neq")) {
-            return BOOL_VAL(!IS_NUMBER(right_side) || receiver.num != right_side.num);
+        switch (op) {
+            case BUILTIN_ADD:
+                return INTEGER_VAL(AS_NUMBER(receiver) + AS_NUMBER(right_side));
+            case BUILTIN_SUB:
+                return INTEGER_VAL(AS_NUMBER(receiver) - AS_NUMBER(right_side));
+            case BUILTIN_MUL:
+                return INTEGER_VAL(AS_NUMBER(receiver) * AS_NUMBER(right_side));
+            case BUILTIN_DIV:
+                return INTEGER_VAL(AS_NUMBER(receiver) / AS_NUMBER(right_side));
+            case BUILTIN_MOD:
+                return INTEGER_VAL(AS_NUMBER(receiver) % AS_NUMBER(right_side));
+            case BUILTIN_LE:
+                return BOOL_VAL(IS_NUMBER(right_side) && AS_NUMBER(receiver) <= AS_NUMBER(right_side));
+            case BUILTIN_GE:
+                return BOOL_VAL(IS_NUMBER(right_side) && AS_NUMBER(receiver) >= AS_NUMBER(right_side));
+            case BUILTIN_LT:
+                return BOOL_VAL(IS_NUMBER(right_side) && AS_NUMBER(receiver) < AS_NUMBER(right_side));
+            case BUILTIN_GT:
+                return BOOL_VAL(IS_NUMBER(right_side) && AS_NUMBER(receiver) > AS_NUMBER(right_side));
+            case BUILTIN_EQ:
+                return BOOL_VAL(IS_NUMBER(right_side) && AS_NUMBER(receiver) == AS_NUMBER(right_side));
+            case BUILTIN_NEQ:
+                return BOOL_VAL(!IS_NUMBER(right_side) || AS_NUMBER(receiver) != AS_NUMBER(right_side));
+            default:
+                break;
         }
     } else if (IS_NULL(receiver)) {
-        if (CMP(method_name->data, "==", "eq")) {
-            return BOOL_VAL(IS_NULL(right_side));
-        } else if (CMP(method_name->data, "!=", "neq")) {
-            return BOOL_VAL(!IS_NULL(right_side));
+        switch (op) {
+            case BUILTIN_EQ:
+                return BOOL_VAL(IS_NULL(right_side));
+            case BUILTIN_NEQ:
+                return BOOL_VAL(!IS_NULL(right_side));
+            default:
+                break;
         }
     } else if (IS_ARRAY(receiver)) {
         obj_array_t* arr = AS_ARRAY(receiver);
-        if (CMP(method_name->data, "set", "set")) {
-            assert(IS_NUMBER(right_right_side));
-            arr->values[right_right_side.num] = right_side;
-            return right_side;
-        } else if (CMP(method_name->data, "get", "get")) {
-            return arr->values[right_side.num];
+        switch (op) {
+            case BUILTIN_SET:
+                assert(IS_NUMBER(right_right_side));
+                arr->values[AS_NUMBER(right_right_side)] = right_side;
+                return right_side;
+            case BUILTIN_GET:
+                return arr->values[AS_NUMBER(right_side)];
+            default:
+                break;
         }
     } else if (IS_BOOL(receiver)) {
-        if (CMP(method_name->data, "|", "or")) {
-            return BOOL_VAL(receiver.b || right_side.b);
-        } else if (CMP(method_name->data, "&", "and")) {
-            return BOOL_VAL(receiver.b && right_side.b);
-        } else if (CMP(method_name->data, "==", "eq")) {
-            return BOOL_VAL(receiver.b == right_side.b);
-        } else if (CMP(method_name->data, "!=", "neq")) {
-            return BOOL_VAL(receiver.b != right_side.b);
+        switch (op) {
+            case BUILTIN_OR:
+                return BOOL_VAL(AS_BOOL(receiver) || AS_BOOL(right_side));
+            case BUILTIN_AND:
+                return BOOL_VAL(AS_BOOL(receiver) && AS_BOOL(right_side));
+            case BUILTIN_EQ:
+                return BOOL_VAL(AS_BOOL(receiver) == AS_BOOL(right_side));
+            case BUILTIN_NEQ:
+                return BOOL_VAL(AS_BOOL(receiver) != AS_BOOL(right_side));
+            default:
+                break;
         }
     }
     fprintf(stderr, "Unknown operator '%s' to dispatch.\n", method_name->data);
     exit(63);
-#undef CMP
 }
 
-/// Recursively traverses instance and its parent classes to find field.
-value_t find_field(value_t ins, obj_string_t* field_name) {
-    if (!IS_INSTANCE(ins)) {
-        fprintf(stderr, "Unknown field '%s'.", field_name->data);
-        exit(123);
+static inline obj_class_t* class_of(value_t value) {
+    return IS_INSTANCE(value) ? AS_INSTANCE(value)->class : NULL;
+}
+
+/// Finds method of given name in the receiver or its parent objects. The call
+/// site inline cache is consulted once per call, keyed by the receiver class,
+/// the parents are searched only on cache miss.
+/// @param receiver Replaced by the object that defines the method, or by the
+///                 primitive parent if none of the classes defines it.
+/// @return The method or NULL if the builtin should be dispatched.
+static obj_function_t* lookup_method(vm_t* vm, method_cache_t* cache, value_t* receiver, obj_string_t* name) {
+    obj_class_t* class = class_of(*receiver);
+    if (class == NULL) {
+        return NULL;
     }
-    value_t field_val;
-    if (!hash_map_fetch(&AS_INSTANCE(ins)->fields, field_name, &field_val)) {
-        return find_field(AS_INSTANCE(ins)->extends, field_name);
+    for (uint8_t i = 0; i < cache->count; ++ i) {
+        if (cache->entries[i].path[0] != class) {
+            continue;
+        }
+        // Same receiver class can have parents of different classes
+        value_t walk = *receiver;
+        uint8_t level = 0;
+        while (level < cache->entries[i].depth && class_of(walk) == cache->entries[i].path[level]) {
+            walk = AS_INSTANCE(walk)->extends;
+            level += 1;
+        }
+        if (level == cache->entries[i].depth && class_of(walk) == cache->entries[i].path[level]) {
+            vm->method_cache_hits += 1;
+            *receiver = walk;
+            return cache->entries[i].method;
+        }
+    }
+
+    vm->method_cache_misses += 1;
+    obj_class_t* path[METHOD_CACHE_DEPTH];
+    obj_function_t* func = NULL;
+    value_t walk = *receiver;
+    size_t depth = 0;
+    for (;; ++ depth) {
+        obj_class_t* level_class = class_of(walk);
+        if (depth < METHOD_CACHE_DEPTH) {
+            path[depth] = level_class;
+        }
+        if (level_class == NULL) {
+            break;
+        }
+        value_t method;
+        if (hash_map_fetch(&level_class->methods, name, &method)) {
+            func = AS_FUNCTION(method);
+            break;
+        }
+        walk = AS_INSTANCE(walk)->extends;
     }
-    return field_val;
+    // Megamorphic call sites and too deep hierarchies always do the lookup.
+    if (depth < METHOD_CACHE_DEPTH && cache->count < METHOD_CACHE_SIZE) {
+        cache->entries[cache->count].depth = depth;
+        memcpy(cache->entries[cache->count].path, path, (depth + 1) * sizeof(*path));
+        cache->entries[cache->count].method = func;
+        cache->count += 1;
+    }
+    *receiver = walk;
+    return func;
 }
 
+/// Finds index of the field in instances of the class. The field access
+/// inline cache is consulted first, the class fields are searched only on cache miss.
+/// @return The index or -1 if the class doesn't have the field.
+static int16_t lookup_field(field_cache_t* cache, obj_class_t* class, obj_string_t* name) {
+    for (uint8_t i = 0; i < cache->count; ++ i) {
+        if (cache->entries[i].class == class) {
+            return cache->entries[i].index;
+        }
+    }
 
-/// Recursively traverses class instance and it's parents to update field.
-void set_field(value_t ins, obj_string_t* field_name, value_t new_val) {
-    if (!IS_INSTANCE(ins)) {
-        fprintf(stderr, "Unknown field '%s'.", field_name->data);
-        exit(123);
+    int16_t index = -1;
+    for (uint16_t i = 0; i < class->size; ++ i) {
+        // Field names are interned
+        if (class->fields[i] == name) {
+            index = i;
+            break;
+        }
     }
-    if (!hash_map_update(&AS_INSTANCE(ins)->fields, field_name, new_val)) {
-        set_field(AS_INSTANCE(ins)->extends, field_name, new_val);
+    if (cache->count < FIELD_CACHE_SIZE) {
+        cache->entries[cache->count].class = class;
+        cache->entries[cache->count].index = index;
+        cache->count += 1;
     }
+    return index;
 }
 
-interpret_result_t interpret(vm_t* vm)
-{
-    push_frame(vm, NULL);
-    for (;(size_t)(vm->ip - vm->bytecode.bytecode) < vm->bytecode.size;) {
+/// Traverses instance and its parents to find the field.
+/// @param owner - Set to the instance which contains the field.
+/// @return Pointer to the field value.
+static value_t* find_field(value_t ins, const instruction_t* access, obj_t** owner) {
+    for (;;) {
+        if (!IS_INSTANCE(ins)) {
+            fprintf(stderr, "Unknown field '%s'.", access->name->data);
+            exit(123);
+        }
+        obj_instance_t* instance = AS_INSTANCE(ins);
+        int16_t index = lookup_field(access->field_cache, instance->class, access->name);
+        if (index >= 0) {
+            *owner = &instance->obj;
+            return &instance->fields[index];
+        }
+        ins = instance->extends;
+    }
+}
+
+/**
+ * The interpreter loop can be compiled in two flavours. By default, on compilers
+ * supporting labels as values (GCC, clang), every instruction handler jumps
+ * directly to the handler of the next instruction, whose address is stored
+ * in the pre-decoded instruction itself. Defining __SWITCH_DISPATCH__ falls
+ * back to the portable switch based loop.
+ *
+ * In both cases the instruction pointer is kept in a local variable and only
+ * written back to vm->ip when some helper function needs it.
+ */
+#if defined(__GNUC__) && !defined(__SWITCH_DISPATCH__)
+#define THREADED_DISPATCH
+#endif
+
+#define STORE_IP() (vm->ip = ip)
+// Frame can change only through calls and returns, the locals are
+// reloaded after them.
+#define LOAD_IP() (ip = vm->ip, locals = get_locals(vm))
+
 #ifdef __DEBUG__
-        dissasemble_instruction(&vm->bytecode, vm->ip - vm->bytecode.bytecode);
-        puts("");
+#define TRACE_INSTRUCTION() (dissasemble_stack(&vm->op_stack),                    \
+        dissasemble_instruction(&vm->bytecode, ip->offset),                 \
+        puts(""))
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif // __DEBUG__
-        switch (READ_BYTE_IP(vm)) {
-            case OP_RETURN: {
-                uint8_t* old_ip = pop_frame(&vm->frames);
-                // If global frame is popped.
-                if (old_ip == NULL) {
-                    return INTERPRET_OK;
-                }
-                vm->ip = old_ip;
-                break;
-            }
-            case OP_LABEL:
-                // We have updated jumps,
-                READ_WORD_IP(vm);
-                break;
-            case OP_DROP:
-                pop(&vm->op_stack);
-                break;
-            case OP_LITERAL: {
-                uint16_t index = READ_WORD_IP(vm);
-                push(vm, vm->bytecode.pool.data[index]);
-                break;
-            }
-            case OP_PRINT:
-                if (!interpret_print(vm)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            case OP_GET_LOCAL: {
-                uint16_t index = READ_WORD_IP(vm);
-                push(vm, get_top_frame(&vm->frames)->locals_vector[index]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint16_t index = READ_WORD_IP(vm);
-                get_top_frame(&vm->frames)->locals_vector[index] = peek(&vm->op_stack, 1);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                uint16_t index = READ_WORD_IP(vm);
-                obj_string_t* name = AS_STRING(vm->bytecode.pool.data[index]);
-                value_t val;
-                hash_map_fetch(&vm->global_var, name, &val);
-                push(vm, val);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                uint16_t index = READ_WORD_IP(vm);
-                obj_string_t* name = AS_STRING(vm->bytecode.pool.data[index]);
-                value_t val = peek(&vm->op_stack, 1);
-                hash_map_update(&vm->global_var, name, val);
-                break;
-            }
-            case OP_BRANCH: {
-                value_t val = pop(&vm->op_stack);
-                if(IS_FALSY(val)) {
-                    vm->ip += 3;
-                    break;
-                }
-                fallthrough;
-            }
-            case OP_JUMP: {
-                // Jump index is not in little endian.
-                size_t index = *vm->ip << 16 | *(vm->ip + 1) << 8 | *(vm->ip + 2);
-                vm->ip = &vm->bytecode.bytecode[index];
-                break;
-            }
-            case OP_OBJECT: {
-                obj_class_t* class = AS_CLASS(vm->bytecode.pool.data[READ_WORD_IP(vm)]);
-                hash_map_t fields;
-                init_hash_map(&fields);
-                // Values are only peaked, so the GC can reach them
-                for (ssize_t i = class->size - 1; i >= 0; -- i) {
-                    hash_map_insert(&fields, class->fields[i], peek(&vm->op_stack, class->size - i));
-                }
-                value_t extends = peek(&vm->op_stack, class->size + 1);
-                value_t instance = OBJ_INSTANCE_VAL(class, fields, extends, vm);
 
-                // If we had some asynchronnous GC this could be a problematic part
-                for (size_t i = 0; i < class->size + 1; ++ i) {
-                    pop(&vm->op_stack);
-                }
-                push(vm, instance);
-                break;
+#ifdef THREADED_DISPATCH
+#define DISPATCH_LOOP() DISPATCH();
+#define CASE(opcode) L_##opcode:
+#define DEFAULT_CASE() L_UNKNOWN:
+#define DISPATCH() do { TRACE_INSTRUCTION(); ins = ip++; goto *ins->handler; } while (0)
+#else
+#define DISPATCH_LOOP() for (;;) switch (TRACE_INSTRUCTION(), (ins = ip++)->opcode)
+#define CASE(opcode) case opcode:
+#define DEFAULT_CASE() default:
+#define DISPATCH() continue
+#endif // THREADED_DISPATCH
+
+#ifdef THREADED_DISPATCH
+// Labels as values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+
+interpret_result_t interpret(vm_t* vm)
+{
+#ifdef THREADED_DISPATCH
+    static const void* dispatch_table[256] = {
+        [0 ... 255] = &&L_UNKNOWN,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_DROP] = &&L_OP_DROP,
+        [OP_LITERAL] = &&L_OP_LITERAL,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+        [OP_BRANCH] = &&L_OP_BRANCH,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_OBJECT] = &&L_OP_OBJECT,
+        [OP_GET_FIELD] = &&L_OP_GET_FIELD,
+        [OP_SET_FIELD] = &&L_OP_SET_FIELD,
+        [OP_CALL_FUNCTION] = &&L_OP_CALL_FUNCTION,
+        [OP_ARRAY] = &&L_OP_ARRAY,
+        [OP_CALL_METHOD] = &&L_OP_CALL_METHOD,
+        [OP_ADD_INT] = &&L_OP_ADD_INT,
+        [OP_SUB_INT] = &&L_OP_SUB_INT,
+        [OP_MUL_INT] = &&L_OP_MUL_INT,
+        [OP_DIV_INT] = &&L_OP_DIV_INT,
+        [OP_MOD_INT] = &&L_OP_MOD_INT,
+        [OP_LT_INT] = &&L_OP_LT_INT,
+        [OP_LE_INT] = &&L_OP_LE_INT,
+        [OP_GT_INT] = &&L_OP_GT_INT,
+        [OP_GE_INT] = &&L_OP_GE_INT,
+        [OP_EQ_INT] = &&L_OP_EQ_INT,
+        [OP_NEQ_INT] = &&L_OP_NEQ_INT,
+        [OP_ARRAY_GET] = &&L_OP_ARRAY_GET,
+        [OP_ARRAY_SET] = &&L_OP_ARRAY_SET,
+    };
+    // Thread the code, labels are not present in the pre-decoded instructions.
+    for (size_t i = 0; i < vm->bytecode.code_size; ++ i) {
+        vm->bytecode.code[i].handler = dispatch_table[vm->bytecode.code[i].opcode];
+    }
+#endif
+    // Bytecode is terminated by OP_RETURN (see parse), so the loop doesn't
+    // have to check whether the ip is still inside of the bytecode.
+    instruction_t* ip = vm->ip;
+    const instruction_t* ins;
+    reserve_stack(&vm->op_stack, vm->stack_size);
+    if (!push_frame(vm, NULL, vm->entry, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    value_t* locals = get_locals(vm);
+    DISPATCH_LOOP() {
+        CASE(OP_RETURN) {
+            // If global frame is popped.
+            if (get_top_frame(&vm->frames)->ip_backup == NULL) {
+                pop_frame(vm);
+                STORE_IP();
+                return INTERPRET_OK;
             }
-            case OP_GET_FIELD: {
-                obj_string_t* field_name = AS_STRING(vm->bytecode.pool.data[READ_WORD_IP(vm)]);
-                push(vm, find_field(pop(&vm->op_stack), field_name));
-                break;
+            // Drop the frame and leave only the returned value on the stack
+            value_t result = peek(&vm->op_stack, 1);
+            ip = pop_frame(vm);
+            push(vm, result);
+            locals = get_locals(vm);
+            DISPATCH();
+        }
+        CASE(OP_DROP)
+            pop(&vm->op_stack);
+            DISPATCH();
+        CASE(OP_LITERAL)
+            push(vm, ins->value);
+            DISPATCH();
+        CASE(OP_PRINT)
+            if (!interpret_print(vm, ins->value, ins->arg_cnt)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_FIELD: {
-                obj_string_t* field_name = AS_STRING(vm->bytecode.pool.data[READ_WORD_IP(vm)]);
-                value_t val = pop(&vm->op_stack);
-                value_t instance = pop(&vm->op_stack);
-                set_field(instance, field_name, val);
-                push(vm, val);
-                break;
+            DISPATCH();
+        CASE(OP_GET_LOCAL)
+            push(vm, locals[ins->index]);
+            DISPATCH();
+        CASE(OP_SET_LOCAL)
+            locals[ins->index] = peek(&vm->op_stack, 1);
+            DISPATCH();
+        CASE(OP_GET_GLOBAL)
+            push(vm, vm->globals[ins->slot]);
+            DISPATCH();
+        CASE(OP_SET_GLOBAL)
+            // Globals are GC roots, no write barrier is needed.
+            vm->globals[ins->slot] = peek(&vm->op_stack, 1);
+            DISPATCH();
+        CASE(OP_BRANCH) {
+            value_t val = pop(&vm->op_stack);
+            if(!IS_FALSY(val)) {
+                ip = ins->target;
             }
-            case OP_CALL_FUNCTION: {
-                uint16_t index = READ_WORD_IP(vm);
+            DISPATCH();
+        }
+        CASE(OP_JUMP)
+            ip = ins->target;
+            DISPATCH();
+        CASE(OP_OBJECT) {
+            size_t size = AS_CLASS(ins->value)->size;
+            // Values are only peaked, so the GC can reach (and move) them.
+            // Fields are on the stack in the order of class fields.
+            value_t* fields = &vm->op_stack.data[vm->op_stack.size - size];
+            value_t* extends = fields - 1;
+            // The class is read from the instruction, the compacting GC can move it too
+            value_t instance = OBJ_INSTANCE_VAL(&ins->value, fields, extends, vm);
+
+            // If we had some asynchronnous GC this could be a problematic part
+            vm->op_stack.size -= size + 1;
+            push(vm, instance);
+            DISPATCH();
+        }
+        CASE(OP_GET_FIELD) {
+            obj_t* owner;
+            push(vm, *find_field(pop(&vm->op_stack), ins, &owner));
+            DISPATCH();
+        }
+        CASE(OP_SET_FIELD) {
+            value_t val = pop(&vm->op_stack);
+            value_t instance = pop(&vm->op_stack);
+            obj_t* owner;
+            *find_field(instance, ins, &owner) = val;
+            gc_write_barrier(vm, owner, val);
+            push(vm, val);
+            DISPATCH();
+        }
+        CASE(OP_CALL_FUNCTION) {
 #ifdef __DEBUG__
-                assert(IS_STRING(vm->bytecode.pool.data[index]));
-                printf("Calling %s\n", AS_STRING(vm->bytecode.pool.data[index])->data);
+            printf("Calling %s\n", ins->name->data);
 #endif
-                obj_string_t* fun_name = AS_STRING(vm->bytecode.pool.data[index]);
-                uint8_t arg_cnt = READ_BYTE_IP(vm);
-                // Fetch function from global pool
-                obj_function_t* fun = get_function(fun_name, vm);
-                interpret_function_call(vm, fun, arg_cnt);
-                break;
-            }
-
-            case OP_ARRAY: {
-                value_t init = pop(&vm->op_stack);
-                value_t size = pop(&vm->op_stack);
-
-                value_t array = OBJ_ARRAY_VAL(AS_NUMBER(size), init, vm);
-                push(vm, array);
-                break;
+            // Fetch function from global pool
+            obj_function_t* fun = get_function(ins, vm);
+            STORE_IP();
+            if (interpret_function_call(vm, fun, ins->arg_cnt) != INTERPRET_OK) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL_METHOD: {
-                uint16_t index = READ_WORD_IP(vm);
-                obj_string_t* method_name = AS_STRING(vm->bytecode.pool.data[index]);
-                int args_cnt = READ_BYTE_IP(vm);
-
-                value_t walk = vm->op_stack.data[vm->op_stack.size - args_cnt];
-                value_t method;
-                // Method dispatch, walk the inheritance tree and try finding the called method.
-                // If primitive object is the parent, then try to call the builtin method.
-                for (;;) {
-                    if (IS_INSTANCE(walk)) {
-                        // If not found then walk up the tree
-                        if (!hash_map_fetch(&AS_INSTANCE(walk)->class->methods, method_name, &method)) {
-                            walk = AS_INSTANCE(walk)->extends;
-                        } else {
-                            obj_function_t* func = AS_FUNCTION(method);
-                            // Update the object to be the extended one
-                            vm->op_stack.data[vm->op_stack.size - args_cnt] = walk;
-                            interpret_function_call(vm, func, args_cnt);
-                            break;
-                        }
-                    // If current object is not class instance then it must be primitive type.
-                    // Try to call the operator from primitive type. The function fails if
-                    // name of the operator doesn't correspond to any existing operator,
-                    // so it also fails if a method isn't in any classes.
-                    } else {
-                        // Dispatch builtin also handles calls to non-existing method as it's side-effect.
-                        value_t first_arg = pop(&vm->op_stack);
-                        value_t second_arg = (args_cnt == 3) ? pop(&vm->op_stack) : NULL_VAL;
-                        value_t result = dispatch_builtin(method_name, walk, first_arg, second_arg);
-                        pop(&vm->op_stack); // Pop one more for the receiver
-                        push(vm, result);
-                        break;
-                    }
+            LOAD_IP();
+            DISPATCH();
+        }
+        CASE(OP_ARRAY) {
+            // Values are only peeked, so the GC can reach (and move) the initial value.
+            value_t* init = &vm->op_stack.data[vm->op_stack.size - 1];
+            value_t array = OBJ_ARRAY_VAL(AS_NUMBER(peek(&vm->op_stack, 2)), init, vm);
+            vm->op_stack.size -= 2;
+            push(vm, array);
+            DISPATCH();
+        }
+        CASE(OP_CALL_METHOD) generic_call_method: {
+            obj_string_t* method_name = ins->name;
+            int args_cnt = ins->arg_cnt;
+
+            value_t walk = vm->op_stack.data[vm->op_stack.size - args_cnt];
+            // Method dispatch, walk the inheritance tree and try finding the called method.
+            // If primitive object is the parent, then try to call the builtin method.
+            obj_function_t* func = lookup_method(vm, ins->cache, &walk, method_name);
+            if (func != NULL) {
+                // Update the object to be the extended one
+                vm->op_stack.data[vm->op_stack.size - args_cnt] = walk;
+                STORE_IP();
+                if (interpret_function_call(vm, func, args_cnt) != INTERPRET_OK) {
+                    return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                LOAD_IP();
+            // If no class defines the method, the walk ended in a primitive type.
+            // Try to call the operator from primitive type. The function fails if
+            // name of the operator doesn't correspond to any existing operator,
+            // so it also fails if a method isn't in any classes.
+            } else {
+                // Dispatch builtin also handles calls to non-existing method as it's side-effect.
+                value_t first_arg = pop(&vm->op_stack);
+                value_t second_arg = (args_cnt == 3) ? pop(&vm->op_stack) : NULL_VAL;
+                value_t result = dispatch_builtin(ins->builtin, method_name, walk, first_arg, second_arg);
+                if (ins->builtin == BUILTIN_SET) {
+                    gc_write_barrier(vm, AS_OBJ(walk), first_arg);
+                }
+                pop(&vm->op_stack); // Pop one more for the receiver
+                push(vm, result);
             }
-            default:
-                fprintf(stderr, "Unknown instruction to interpret.\n");
-                return INTERPRET_RUNTIME_ERROR;
-
+            DISPATCH();
         }
-#ifdef __DEBUG__
-        dissasemble_stack(&vm->op_stack);
-#endif //__DEBUG__
+        // Binary operators on integers, the receiver and the argument
+        // are the two values on top of the stack.
+#define INT_OPERATOR(opcode, value_type, operator)                                      \
+        CASE(opcode) {                                                                  \
+            value_t* operands = &vm->op_stack.data[vm->op_stack.size - 2];              \
+            if (!IS_NUMBER(operands[0]) || !IS_NUMBER(operands[1])) {                   \
+                goto generic_call_method;                                               \
+            }                                                                           \
+            operands[0] = value_type(AS_NUMBER(operands[0]) operator AS_NUMBER(operands[1])); \
+            vm->op_stack.size -= 1;                                                     \
+            DISPATCH();                                                                 \
+        }
+        INT_OPERATOR(OP_ADD_INT, INTEGER_VAL, +)
+        INT_OPERATOR(OP_SUB_INT, INTEGER_VAL, -)
+        INT_OPERATOR(OP_MUL_INT, INTEGER_VAL, *)
+        INT_OPERATOR(OP_DIV_INT, INTEGER_VAL, /)
+        INT_OPERATOR(OP_MOD_INT, INTEGER_VAL, %)
+        INT_OPERATOR(OP_LT_INT, BOOL_VAL, <)
+        INT_OPERATOR(OP_LE_INT, BOOL_VAL, <=)
+        INT_OPERATOR(OP_GT_INT, BOOL_VAL, >)
+        INT_OPERATOR(OP_GE_INT, BOOL_VAL, >=)
+        INT_OPERATOR(OP_EQ_INT, BOOL_VAL, ==)
+        INT_OPERATOR(OP_NEQ_INT, BOOL_VAL, !=)
+#undef INT_OPERATOR
+        CASE(OP_ARRAY_GET) {
+            // Stack contains the array and the index.
+            value_t* operands = &vm->op_stack.data[vm->op_stack.size - 2];
+            if (!IS_ARRAY(operands[0]) || !IS_NUMBER(operands[1])) {
+                goto generic_call_method;
+            }
+            operands[0] = AS_ARRAY(operands[0])->values[AS_NUMBER(operands[1])];
+            vm->op_stack.size -= 1;
+            DISPATCH();
+        }
+        CASE(OP_ARRAY_SET) {
+            // Stack contains the array, the index and the value.
+            value_t* operands = &vm->op_stack.data[vm->op_stack.size - 3];
+            if (!IS_ARRAY(operands[0]) || !IS_NUMBER(operands[1])) {
+                goto generic_call_method;
+            }
+            AS_ARRAY(operands[0])->values[AS_NUMBER(operands[1])] = operands[2];
+            gc_write_barrier(vm, AS_OBJ(operands[0]), operands[2]);
+            operands[0] = operands[2];
+            vm->op_stack.size -= 2;
+            DISPATCH();
+        }
+        DEFAULT_CASE()
+            fprintf(stderr, "Unknown instruction to interpret.\n");
+            return INTERPRET_RUNTIME_ERROR;
     }
     return INTERPRET_OK;
 }
 
-#undef READ_BYTE_IP
-#undef READ_WORD_IP
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+#undef STORE_IP
+#undef LOAD_IP
+#undef TRACE_INSTRUCTION
+#undef DISPATCH_LOOP
+#undef CASE
+#undef DEFAULT_CASE
+#undef DISPATCH
@@ -1,6 +1,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "include/buddy_alloc.h"
 #include "asserts.h"
 
@@ -115,8 +118,158 @@ TEST(extensiveTest) {
     return EXIT_SUCCESS;
 }
 
+TEST(randomFreeTest) {
+    // One million of the smallest buddy blocks, each takes 256 bytes
+    const size_t count = 1000000;
+    const size_t size = 256 * 1048576;
+    uint8_t* mem_pool = malloc(size);
+    void** ptrs = malloc(count * sizeof(void*));
+    heap_init(mem_pool, size, NULL);
+    for (size_t i = 0; i < count; ++i) {
+        ASSERT_W((ptrs[i] = heap_alloc(HEAP_SLAB_MAX + 1)) != NULL);
+        *(size_t*)ptrs[i] = i;
+    }
+    // Fisher-Yates shuffle with xorshift, so the order is the same in every run
+    uint64_t seed = 88172645463325252ULL;
+    for (size_t i = count - 1; i > 0; --i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        size_t j = seed % (i + 1);
+        void* tmp = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+
+    clock_t start = clock();
+    for (size_t i = 0; i < count; ++i) {
+        ASSERT_W(heap_free(ptrs[i]));
+    }
+    double ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+    printf("Freed %zu blocks in random order in %.1f ms\n", count, ms);
+    ASSERT_W(heap_done() == 0);
+    ASSERT_W(heap_used() == 0);
+    // Everything was merged back into the single block
+    void* whole = heap_alloc(size / 2 + 1);
+    ASSERT_W(whole != NULL);
+    ASSERT_W(heap_free(whole));
+
+    free(ptrs);
+    free(mem_pool);
+    return EXIT_SUCCESS;
+}
+
+TEST(sizeClassTest) {
+    static uint8_t mem_pool[2097152];
+    heap_init(mem_pool, 2097152, NULL);
+    const size_t sizes[] = {1, 16, 17, 40, 64, 100, 128};
+    void* ptrs[7][1000];
+    for (size_t i = 0; i < 7; ++ i) {
+        for (size_t j = 0; j < 1000; ++ j) {
+            uint8_t* p = heap_alloc(sizes[i]);
+            ASSERT_W(p != NULL);
+            ASSERT_W((uintptr_t)p % 8 == 0);
+            memset(p, (int)i, sizes[i]);
+            ptrs[i][j] = p;
+        }
+    }
+    ASSERT_W(heap_done() == 7 * 1000);
+
+    heap_class_stats_t stats[HEAP_SIZE_CLASSES];
+    heap_class_stats(stats);
+    const size_t used[HEAP_SIZE_CLASSES] = {2000, 1000, 1000, 1000, 2000};
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i) {
+        ASSERT_W(stats[i].used_slots == used[i]);
+        ASSERT_W(stats[i].runs > 0 && stats[i].used_slots <= stats[i].total_slots);
+    }
+
+    // Growing within the class keeps the slot, growing past it moves the data
+    ASSERT_W(heap_realloc(ptrs[2][0], 32) == ptrs[2][0]);
+    uint8_t* moved = heap_realloc(ptrs[2][0], 200);
+    ASSERT_W(moved != NULL && moved[0] == 2 && moved[16] == 2);
+    ptrs[2][0] = moved;
+
+    for (size_t i = 0; i < 7; ++ i) {
+        for (size_t j = 0; j < 1000; ++ j) {
+            ASSERT_W(((uint8_t*)ptrs[i][j])[0] == i);
+            ASSERT_W(heap_free(ptrs[i][j]));
+        }
+    }
+    ASSERT_W(heap_done() == 0);
+    // Only the last run of each class is kept
+    heap_class_stats(stats);
+    for (size_t i = 0; i < HEAP_SIZE_CLASSES; ++ i) {
+        ASSERT_W(stats[i].used_slots == 0 && stats[i].runs == 1);
+    }
+    return EXIT_SUCCESS;
+}
+
+TEST(reservedHeapTest) {
+    const size_t size = 64 * 1048576;
+    uint8_t* mem_pool = heap_reserve(size, false);
+    ASSERT_W(mem_pool != NULL);
+    heap_init(mem_pool, size, NULL);
+    uint8_t* p = heap_alloc(size / 2);
+    ASSERT_W(p != NULL);
+    memset(p, 0xAB, size / 2);
+
+    long page = sysconf(_SC_PAGESIZE);
+    uint8_t* middle = (uint8_t*)(((uintptr_t)p + size / 4) & ~(uintptr_t)(page - 1));
+    unsigned char resident;
+    ASSERT_W(mincore(middle, page, &resident) == 0 && (resident & 1));
+    // The whole heap is free again, its pages are given back when the collector asks
+    ASSERT_W(heap_free(p));
+    ASSERT_W(mincore(middle, page, &resident) == 0 && (resident & 1));
+    heap_release_pages();
+    ASSERT_W(mincore(middle, page, &resident) == 0 && !(resident & 1));
+
+    // Discarded pages are zero when they are used again
+    uint32_t* q = heap_alloc(size / 2);
+    ASSERT_W(q != NULL && q[size / 16] == 0);
+    ASSERT_W(heap_free(q));
+    ASSERT_W(heap_done() == 0);
+    munmap(mem_pool, size);
+    return EXIT_SUCCESS;
+}
+
+TEST(inPlaceReallocTest) {
+    static uint8_t mem_pool[2097152];
+    heap_init(mem_pool, 2097152, NULL);
+    // The buddies of the first block are free, it grows without moving
+    uint8_t* p = heap_alloc(1000);
+    ASSERT_W(p != NULL);
+    memset(p, 7, 1000);
+    ASSERT_W(heap_realloc(p, 4000) == p);
+    ASSERT_W(heap_used() == 4096);
+    memset(p, 7, 4000);
+
+    // The buddy is taken, the block has to move
+    uint8_t* q = heap_alloc(1000);
+    ASSERT_W(q == p + 4096);
+    uint8_t* moved = heap_realloc(p, 8000);
+    ASSERT_W(moved != p && moved[0] == 7 && moved[3999] == 7);
+
+    // Shrinking frees the tail, which can be allocated again
+    size_t used = heap_used();
+    ASSERT_W(heap_realloc(moved, 100) == moved);
+    ASSERT_W(moved[99] == 7);
+    ASSERT_W(heap_used() == used - 8192 + 128);
+    uint8_t* tail = heap_alloc(4000);
+    ASSERT_W(tail == moved + 4096);
+
+    ASSERT_W(heap_free(moved));
+    ASSERT_W(heap_free(q));
+    ASSERT_W(heap_free(tail));
+    ASSERT_W(heap_done() == 0 && heap_used() == 0);
+    return EXIT_SUCCESS;
+}
+
 int main(void) {
     RUN_TEST(basicTest);
     RUN_TEST(basicTest2);
     RUN_TEST(extensiveTest);
+    RUN_TEST(randomFreeTest);
+    RUN_TEST(sizeClassTest);
+    RUN_TEST(reservedHeapTest);
+    RUN_TEST(inPlaceReallocTest);
 }
@@ -0,0 +1,483 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "asserts.h"
+#include "include/vm.h"
+#include "include/memory.h"
+#include "include/constant.h"
+#include "include/buddy_alloc.h"
+#include "include/hashmap.h"
+#include "include/objects.h"
+#include "include/serializer.h"
+
+#define HEAP_SIZE (64 * 1024 * 1024)
+
+static void* heap_pool = NULL;
+
+/// Initializes vm on a fresh heap, collected by the GC of given mode.
+static void init_gc_vm(vm_t* vm, gc_mode_t mode) {
+    free(heap_pool);
+    heap_pool = malloc(HEAP_SIZE);
+    heap_init(heap_pool, HEAP_SIZE, NULL);
+    init_vm(vm);
+    vm->gc_mode = mode;
+    if (mode == GC_GENERATIONAL) {
+        vm->nursery_size = 1024 * 1024;
+    }
+    reserve_stack(&vm->op_stack, 16);
+}
+
+/// Allocates garbage until the nursery is collected at least once.
+static void fill_nursery(vm_t* vm) {
+    size_t collections = vm->minor_collections;
+    value_t init = INTEGER_VAL(0);
+    while (vm->minor_collections == collections) {
+        build_obj_array(8, &init, vm);
+    }
+}
+
+TEST(promotionTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_GENERATIONAL);
+
+    value_t init = INTEGER_VAL(42);
+    push(&vm, OBJ_ARRAY_VAL(4, &init, &vm));
+    ASSERT_W(is_young(&vm, AS_OBJ(vm.op_stack.data[0])));
+
+    fill_nursery(&vm);
+
+    // The array is reachable from the stack, it was promoted
+    value_t promoted = vm.op_stack.data[0];
+    ASSERT_W(!is_young(&vm, AS_OBJ(promoted)));
+    ASSERT_W(AS_ARRAY(promoted)->size == 4);
+    ASSERT_W(AS_NUMBER(AS_ARRAY(promoted)->values[3]) == 42);
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(rememberedSetTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_GENERATIONAL);
+
+    // Too big for the nursery, allocated directly in the old generation
+    value_t init = NULL_VAL;
+    push(&vm, OBJ_ARRAY_VAL(100000, &init, &vm));
+    obj_array_t* old = AS_ARRAY(vm.op_stack.data[0]);
+    ASSERT_W(!is_young(&vm, &old->obj));
+    fill_nursery(&vm);
+    ASSERT_W(vm.remembered_cnt == 0);
+
+    // Young object reachable only through the old array
+    init = INTEGER_VAL(7);
+    old->values[10] = OBJ_ARRAY_VAL(2, &init, &vm);
+    gc_write_barrier(&vm, &old->obj, old->values[10]);
+    ASSERT_W(vm.remembered_cnt == 1 && old->obj.remembered);
+
+    fill_nursery(&vm);
+
+    ASSERT_W(vm.remembered_cnt == 0 && !old->obj.remembered);
+    ASSERT_W(IS_ARRAY(old->values[10]));
+    ASSERT_W(!is_young(&vm, AS_OBJ(old->values[10])));
+    ASSERT_W(AS_NUMBER(AS_ARRAY(old->values[10])->values[1]) == 7);
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(fullCollectionTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_GENERATIONAL);
+
+    value_t init = INTEGER_VAL(1);
+    push(&vm, OBJ_ARRAY_VAL(3, &init, &vm));
+    fill_nursery(&vm);
+    size_t majors = vm.major_collections;
+
+    // Promoted garbage is freed by the full collection
+    run_gc(&vm);
+    ASSERT_W(vm.major_collections == majors + 1);
+    ASSERT_W(vm.nursery_top == vm.nursery_start);
+    ASSERT_W(AS_NUMBER(AS_ARRAY(vm.op_stack.data[0])->values[2]) == 1);
+    size_t objects = 0;
+    for (obj_t* obj = vm.objects; obj != NULL; obj = obj->next) {
+        objects += 1;
+    }
+    ASSERT_W(objects == 1);
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(incrementalTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_INCREMENTAL);
+
+    // Linked list of arrays, the head is on the stack and new nodes
+    // are stored into the old ones while the GC runs.
+    value_t init = NULL_VAL;
+    push(&vm, OBJ_ARRAY_VAL(2, &init, &vm));
+    obj_array_t* tail = AS_ARRAY(vm.op_stack.data[0]);
+    const int NODES = 1000;
+    for (int i = 1; i < NODES; ++ i) {
+        // Garbage, so that the cycles run
+        for (int j = 0; j < 100; ++ j) {
+            build_obj_array(64, &init, &vm);
+        }
+        init = INTEGER_VAL(i);
+        value_t node = OBJ_ARRAY_VAL(2, &init, &vm);
+        AS_ARRAY(node)->values[1] = NULL_VAL;
+        init = NULL_VAL;
+        tail->values[1] = node;
+        gc_write_barrier(&vm, &tail->obj, node);
+        tail = AS_ARRAY(node);
+    }
+    ASSERT_W(vm.major_collections > 0);
+    ASSERT_W(vm.pauses_cnt > vm.major_collections);
+
+    value_t walk = vm.op_stack.data[0];
+    for (int i = 0; i < NODES; ++ i) {
+        ASSERT_W(IS_ARRAY(walk));
+        ASSERT_W(i == 0 || AS_NUMBER(AS_ARRAY(walk)->values[0]) == i);
+        walk = AS_ARRAY(walk)->values[1];
+    }
+    ASSERT_W(IS_NULL(walk));
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(incrementalHeapFullTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_INCREMENTAL);
+    // Each slice blackens only a few objects, the marking lasts long.
+    // The cycle starts early, there is little garbage from before it to free.
+    vm.gc_pause_budget = 0;
+    vm.gc_target_ratio = 1;
+
+    const int LIVE = 100000;
+    value_t init = NULL_VAL;
+    push(&vm, OBJ_ARRAY_VAL(LIVE, &init, &vm));
+    for (int i = 0; i < LIVE; ++ i) {
+        init = INTEGER_VAL(i);
+        value_t arr = OBJ_ARRAY_VAL(1, &init, &vm);
+        AS_ARRAY(vm.op_stack.data[0])->values[i] = arr;
+    }
+
+    // Garbage allocated during the marking survives the cycle, the heap
+    // fills up before the cycle ends and the allocation has to collect it.
+    init = NULL_VAL;
+    size_t garbage = 0;
+    while (garbage < 2 * HEAP_SIZE) {
+        build_obj_array(2000, &init, &vm);
+        garbage += 2000 * sizeof(value_t);
+    }
+    ASSERT_W(vm.major_collections > 0);
+    for (int i = 0; i < LIVE; ++ i) {
+        ASSERT_W(AS_NUMBER(AS_ARRAY(AS_ARRAY(vm.op_stack.data[0])->values[i])->values[0]) == i);
+    }
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(parallelMarkTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_MARK_SWEEP);
+    vm.gc_threads = 4;
+
+    // Arrays of lists, interleaved with garbage
+    value_t init = NULL_VAL;
+    push(&vm, OBJ_ARRAY_VAL(100, &init, &vm));
+    for (int i = 0; i < 100; ++ i) {
+        for (int j = 0; j < 100; ++ j) {
+            build_obj_array(4, &init, &vm);
+            init = INTEGER_VAL(j);
+            value_t node = OBJ_ARRAY_VAL(2, &init, &vm);
+            AS_ARRAY(node)->values[1] = AS_ARRAY(vm.op_stack.data[0])->values[i];
+            AS_ARRAY(vm.op_stack.data[0])->values[i] = node;
+            init = NULL_VAL;
+        }
+    }
+
+    run_gc(&vm);
+    run_gc(&vm);
+    size_t objects = 0;
+    for (obj_t* obj = vm.objects; obj != NULL; obj = obj->next) {
+        ASSERT_W(!is_marked(&vm.mark_bits, obj));
+        objects += 1;
+    }
+    ASSERT_W(objects == 1 + 100 * 100);
+    for (int i = 0; i < 100; ++ i) {
+        value_t walk = AS_ARRAY(vm.op_stack.data[0])->values[i];
+        for (int j = 99; j >= 0; -- j) {
+            ASSERT_W(AS_NUMBER(AS_ARRAY(walk)->values[0]) == j);
+            walk = AS_ARRAY(walk)->values[1];
+        }
+        ASSERT_W(IS_NULL(walk));
+    }
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(concurrentSweepTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_MARK_SWEEP);
+    vm.concurrent_sweep = true;
+    // The sweep runs in the background only if the collections start before the heap is full
+    vm.gc_target_ratio = 100;
+
+    value_t init = INTEGER_VAL(5);
+    push(&vm, OBJ_ARRAY_VAL(3, &init, &vm));
+    for (int i = 0; i < 1000; ++ i) {
+        build_obj_array(16, &init, &vm);
+    }
+    run_gc(&vm);
+    // Objects allocated while sweeping are not swept
+    value_t young = OBJ_ARRAY_VAL(2, &init, &vm);
+    AS_ARRAY(vm.op_stack.data[0])->values[0] = young;
+    for (int i = 0; i < 1000; ++ i) {
+        build_obj_array(16, &init, &vm);
+    }
+
+    // The next collection waits for the sweeper first
+    run_gc(&vm);
+    ASSERT_W(vm.sweeper_running);
+    size_t majors = vm.major_collections;
+    free_gc(&vm);
+    ASSERT_W(!vm.sweeper_running && majors == 2);
+    size_t objects = 0;
+    for (obj_t* obj = vm.objects; obj != NULL; obj = obj->next) {
+        ASSERT_W(!is_marked(&vm.mark_bits, obj));
+        objects += 1;
+    }
+    ASSERT_W(objects == 2);
+    ASSERT_W(AS_NUMBER(AS_ARRAY(young)->values[1]) == 5);
+    ASSERT_W(AS_NUMBER(AS_ARRAY(vm.op_stack.data[0])->values[2]) == 5);
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(compactionTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_MARK_COMPACT);
+
+    // Every other array survives, the free memory is scattered between them
+    const int ARRAYS = 2000;
+    value_t init = NULL_VAL;
+    push(&vm, OBJ_ARRAY_VAL(ARRAYS / 2, &init, &vm));
+    for (int i = 0; i < ARRAYS; ++ i) {
+        init = INTEGER_VAL(i);
+        value_t arr = OBJ_ARRAY_VAL(1000, &init, &vm);
+        if (i % 2 == 0) {
+            AS_ARRAY(vm.op_stack.data[0])->values[i / 2] = arr;
+        }
+    }
+    init = NULL_VAL;
+    uint8_t* before = (uint8_t*)AS_OBJ(AS_ARRAY(vm.op_stack.data[0])->values[ARRAYS / 2 - 1]);
+
+    run_gc(&vm);
+    obj_array_t* root = AS_ARRAY(vm.op_stack.data[0]);
+    ASSERT_W((uint8_t*)AS_OBJ(root->values[ARRAYS / 2 - 1]) < before);
+    for (int i = 0; i < ARRAYS / 2; ++ i) {
+        obj_array_t* arr = AS_ARRAY(root->values[i]);
+        ASSERT_W(arr->size == 1000);
+        ASSERT_W(AS_NUMBER(arr->values[999]) == 2 * i);
+    }
+    // The free memory is in one piece, the big array fits without another collection
+    size_t majors = vm.major_collections;
+    build_obj_array(HEAP_SIZE / 4 / sizeof(value_t), &init, &vm);
+    ASSERT_W(vm.major_collections == majors);
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+/// Value of the global variable of the loaded program.
+static value_t global_value(vm_t* vm, const char* name) {
+    obj_string_t* key = hash_map_find_string(&vm->strings, name, strlen(name), hash_string(name));
+    value_t slot;
+    if (key == NULL || !hash_map_fetch(&vm->global_var, key, &slot)) {
+        return NULL_VAL;
+    }
+    return vm->globals[AS_NUMBER(slot)];
+}
+
+/**
+ * Program with class C, which has field 'f' and method 'm' returning this.f.
+ * Function 'init' stores instance of C with f = 42 into global 'o', function
+ * 'use' stores o.m() into global 'r' and o.f into global 's'.
+ */
+static const uint8_t CACHED_CALLS_PROGRAM[] = {
+    17, 0,                                      // constant pool size
+    0x02, 1, 0, 0, 0, 'f',                      // 0: "f"
+    0x02, 1, 0, 0, 0, 'm',                      // 1: "m"
+    0x04, 0, 0,                                 // 2: slot "f"
+    0x03, 1, 0, 1, 0, 0, 3, 0, 0, 0,            // 3: method m(this)
+        OP_GET_LOCAL, 0, 0,
+        OP_GET_FIELD, 0, 0,
+        OP_RETURN,
+    0x05, 2, 0, 2, 0, 3, 0,                     // 4: class C
+    0x02, 1, 0, 0, 0, 'o',                      // 5: "o"
+    0x04, 5, 0,                                 // 6: slot "o"
+    0x02, 4, 0, 0, 0, 'i', 'n', 'i', 't',       // 7: "init"
+    0x00, 42, 0, 0, 0,                          // 8: 42
+    0x01,                                       // 9: null
+    0x03, 7, 0, 0, 0, 0, 7, 0, 0, 0,            // 10: function init()
+        OP_LITERAL, 9, 0,
+        OP_LITERAL, 8, 0,
+        OP_OBJECT, 4, 0,
+        OP_SET_GLOBAL, 5, 0,
+        OP_DROP,
+        OP_LITERAL, 9, 0,
+        OP_RETURN,
+    0x02, 1, 0, 0, 0, 'r',                      // 11: "r"
+    0x04, 11, 0,                                // 12: slot "r"
+    0x02, 3, 0, 0, 0, 'u', 's', 'e',            // 13: "use"
+    0x02, 1, 0, 0, 0, 's',                      // 14: "s"
+    0x04, 14, 0,                                // 15: slot "s"
+    0x03, 13, 0, 0, 0, 0, 10, 0, 0, 0,          // 16: function use()
+        OP_GET_GLOBAL, 5, 0,
+        OP_CALL_METHOD, 1, 0, 1,
+        OP_SET_GLOBAL, 11, 0,
+        OP_DROP,
+        OP_GET_GLOBAL, 5, 0,
+        OP_GET_FIELD, 0, 0,
+        OP_SET_GLOBAL, 14, 0,
+        OP_DROP,
+        OP_LITERAL, 9, 0,
+        OP_RETURN,
+    5, 0, 6, 0, 10, 0, 12, 0, 15, 0, 16, 0,     // globals
+    10, 0,                                      // entry point
+};
+
+/// Runs the function of the loaded program as if it was the entry point.
+static interpret_result_t run_function(vm_t* vm, const char* name) {
+    vm->entry = AS_FUNCTION(global_value(vm, name));
+    vm->ip = &vm->bytecode.code[vm->entry->code_entry];
+    return interpret(vm);
+}
+
+TEST(compactionCacheTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_MARK_COMPACT);
+
+    // Garbage below the program, everything loaded after it moves
+    value_t init = NULL_VAL;
+    build_obj_array(100000, &init, &vm);
+
+    char path[] = "/tmp/gc_test_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_W(fd != -1);
+    ASSERT_W(write(fd, CACHED_CALLS_PROGRAM, sizeof(CACHED_CALLS_PROGRAM)) == sizeof(CACHED_CALLS_PROGRAM));
+    close(fd);
+    parse(&vm, path);
+    unlink(path);
+
+    // Fill the caches of the call and of both field accesses
+    ASSERT_W(run_function(&vm, "init") == INTERPRET_OK);
+    ASSERT_W(run_function(&vm, "use") == INTERPRET_OK);
+    ASSERT_W(AS_NUMBER(global_value(&vm, "r")) == 42);
+    ASSERT_W(AS_NUMBER(global_value(&vm, "s")) == 42);
+    size_t misses = vm.method_cache_misses;
+    uint8_t* instance = (uint8_t*)AS_OBJ(global_value(&vm, "o"));
+    uint8_t* class = (uint8_t*)AS_INSTANCE(global_value(&vm, "o"))->class;
+
+    run_gc(&vm);
+    ASSERT_W((uint8_t*)AS_OBJ(global_value(&vm, "o")) < instance);
+    ASSERT_W((uint8_t*)AS_INSTANCE(global_value(&vm, "o"))->class < class);
+
+    // The cache entries were forwarded with the class, the calls hit them
+    AS_INSTANCE(global_value(&vm, "o"))->fields[0] = INTEGER_VAL(7);
+    ASSERT_W(run_function(&vm, "use") == INTERPRET_OK);
+    ASSERT_W(AS_NUMBER(global_value(&vm, "r")) == 7);
+    ASSERT_W(AS_NUMBER(global_value(&vm, "s")) == 7);
+    ASSERT_W(vm.method_cache_misses == misses);
+    for (size_t i = 0; i < vm.bytecode.code_size; ++ i) {
+        instruction_t* ins = &vm.bytecode.code[i];
+        if (ins->opcode == OP_CALL_METHOD) {
+            ASSERT_W(ins->cache->count == 1);
+        } else if (ins->opcode == OP_GET_FIELD) {
+            ASSERT_W(ins->field_cache->count == 1);
+        }
+    }
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(targetRatioTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_MARK_SWEEP);
+    vm.gc_target_ratio = 100;
+
+    value_t init = INTEGER_VAL(3);
+    push(&vm, OBJ_ARRAY_VAL(1000, &init, &vm));
+    // Garbage, several times more than the smallest trigger
+    size_t max_used = 0;
+    for (int i = 0; i < 10000; ++ i) {
+        build_obj_array(200, &init, &vm);
+        if (heap_used() > max_used) {
+            max_used = heap_used();
+        }
+    }
+    // Collections started long before the heap was full
+    ASSERT_W(vm.major_collections >= 5);
+    ASSERT_W(max_used < HEAP_SIZE / 4);
+    ASSERT_W(heap_gc_trigger() >= heap_used());
+    ASSERT_W(AS_NUMBER(AS_ARRAY(vm.op_stack.data[0])->values[999]) == 3);
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(bumpAllocationTest) {
+    vm_t vm;
+    init_gc_vm(&vm, GC_MARK_SWEEP);
+
+    value_t init = NULL_VAL;
+    push(&vm, OBJ_ARRAY_VAL(1000, &init, &vm));
+    size_t cls = heap_size_class(sizeof(obj_array_t) + sizeof(value_t));
+    uint8_t* prev = NULL;
+    for (int i = 0; i < 3000; ++ i) {
+        init = INTEGER_VAL(i);
+        value_t arr = OBJ_ARRAY_VAL(1, &init, &vm);
+        // Most of the objects are bumped right after the previous one
+        if (i > 0 && i < 100) {
+            ASSERT_W((uint8_t*)AS_OBJ(arr) == prev + heap_class_size(cls));
+        }
+        prev = (uint8_t*)AS_OBJ(arr);
+        if (i % 3 == 0) {
+            AS_ARRAY(vm.op_stack.data[0])->values[i / 3] = arr;
+        }
+    }
+
+    // The unused part of the bump regions is given back, only the live objects take slots
+    run_gc(&vm);
+    heap_class_stats_t stats[HEAP_SIZE_CLASSES];
+    heap_class_stats(stats);
+    ASSERT_W(stats[cls].used_slots == 1000);
+    for (int i = 0; i < 1000; ++ i) {
+        ASSERT_W(AS_NUMBER(AS_ARRAY(AS_ARRAY(vm.op_stack.data[0])->values[i])->values[0]) == 3 * i);
+    }
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+int main(void) {
+    RUN_TEST(promotionTest);
+    RUN_TEST(rememberedSetTest);
+    RUN_TEST(fullCollectionTest);
+    RUN_TEST(incrementalTest);
+    RUN_TEST(incrementalHeapFullTest);
+    RUN_TEST(parallelMarkTest);
+    RUN_TEST(concurrentSweepTest);
+    RUN_TEST(compactionTest);
+    RUN_TEST(compactionCacheTest);
+    RUN_TEST(targetRatioTest);
+    RUN_TEST(bumpAllocationTest);
+    free(heap_pool);
+}
@@ -5,13 +5,24 @@
 #include "include/constant.h"
 #include "include/buddy_alloc.h"
 
+static void* heap_pool = NULL;
+
+/// Initializes vm on a fresh heap of given size, with the collector off.
+/// The strings in the tests are not rooted, a collection would free them.
+static void init_test_vm(vm_t* vm, size_t heap_size) {
+    free(heap_pool);
+    heap_pool = malloc(heap_size);
+    heap_init(heap_pool, heap_size, NULL);
+    init_vm(vm);
+    vm->gc_on = false;
+}
+
 TEST(basicTest) {
     hash_map_t hm;
-    init_hash_map(&hm);
+    init_hash_map(&hm, system_allocator());
     vm_t vm;
-    init_vm(&vm);
-    heap_init(malloc(10*1024*1024), 10*1024*1024, NULL);
-    value_t a = {.num = 1},b = {.num = 2},c = {.num = 3};
+    init_test_vm(&vm, 10*1024*1024);
+    value_t a = INTEGER_VAL(1), b = INTEGER_VAL(2), c = INTEGER_VAL(3);
 
     obj_string_t* str1 = build_obj_string(4, "abcd", hash_string("abcd"), &vm);
     obj_string_t* str2 = build_obj_string(4, "xyz", hash_string("xyz"), &vm);
@@ -24,19 +35,19 @@ TEST(basicTest) {
 
     value_t res;
     ASSERT_W(hash_map_fetch(&hm, str1, &res));
-    ASSERT_W(res.num == 1);
+    ASSERT_W(AS_NUMBER(res) == 1);
     ASSERT_W(hash_map_fetch(&hm, str2, &res));
-    ASSERT_W(res.num == 2);
+    ASSERT_W(AS_NUMBER(res) == 2);
     ASSERT_W(hash_map_fetch(&hm, str3, &res));
-    ASSERT_W(res.num == 3);
+    ASSERT_W(AS_NUMBER(res) == 3);
 
     ASSERT_W(hash_map_delete(&hm, str2));
 
     ASSERT_W(hash_map_fetch(&hm, str1, &res));
-    ASSERT_W(res.num == 1);
+    ASSERT_W(AS_NUMBER(res) == 1);
     ASSERT_W(!hash_map_fetch(&hm, str2, &res));
     ASSERT_W(hash_map_fetch(&hm, str3, &res));
-    ASSERT_W(res.num == 3);
+    ASSERT_W(AS_NUMBER(res) == 3);
 
     heap_free(str1);
     heap_free(str2);
@@ -47,18 +58,16 @@ TEST(basicTest) {
 
 TEST(reallocationTest) {
     hash_map_t hm;
-    heap_init(malloc(10*1024*1024), 10*1024*1024, NULL);
     vm_t vm;
-    init_vm(&vm);
-    init_hash_map(&hm);
+    init_test_vm(&vm, 10*1024*1024);
+    init_hash_map(&hm, gc_allocator(&vm));
     srand(time(NULL));
     const int SIZE = 10000;
     const int STRING_SIZE = 15;
     value_t vals[SIZE];
     obj_string_t* strings[SIZE];
     for (size_t i = 0; i < SIZE; ++ i) {
-        vals[i].num = rand();
-        vals[i].type = TYPE_INTEGER;
+        vals[i] = INTEGER_VAL(rand());
         char* str = heap_alloc(STRING_SIZE);
         for (size_t j = 0; j < STRING_SIZE - 1; ++ j) {
             str[j] = (rand() % 10) + '0';
@@ -75,23 +84,23 @@ TEST(reallocationTest) {
     for (size_t i = 0; i < SIZE; ++ i) {
         value_t val;
         ASSERT_W(hash_map_fetch(&hm, strings[i], &val));
-        ASSERT_W(val.num == vals[i].num);
-        ASSERT_W(TYPE_INTEGER == vals[i].type);
+        ASSERT_W(AS_NUMBER(val) == AS_NUMBER(vals[i]));
+        ASSERT_W(IS_NUMBER(vals[i]));
     }
 
     for (size_t i = 0; i < SIZE; i += rand() % 10 + 1) {
         ASSERT_W(hash_map_delete(&hm, strings[i]));
         ASSERT_W(!hash_map_delete(&hm, strings[i]));
-        vals[i].num = -1;
+        vals[i] = INTEGER_VAL(-1);
     }
 
     for (size_t i = 0; i < SIZE; ++ i) {
         value_t val;
         bool found = hash_map_fetch(&hm, strings[i], &val);
         if (found) {
-            ASSERT_W(val.num == vals[i].num);
+            ASSERT_W(AS_NUMBER(val) == AS_NUMBER(vals[i]));
         } else {
-            ASSERT_W(vals[i].num == -1);
+            ASSERT_W(AS_NUMBER(vals[i]) == -1);
         }
     }
 
@@ -102,9 +111,201 @@ TEST(reallocationTest) {
     free_hash_map(&hm);
     return EXIT_SUCCESS;
 }
+TEST(internTest) {
+    vm_t vm;
+    init_test_vm(&vm, 10*1024*1024);
+
+    obj_string_t* str1 = intern_obj_string(4, "abcd", hash_bytes("abcd", 4), &vm);
+    obj_string_t* str2 = intern_obj_string(4, "abcdef", hash_bytes("abcdef", 4), &vm);
+    obj_string_t* str3 = intern_obj_string(3, "xyz", hash_bytes("xyz", 3), &vm);
+    ASSERT_W(str1 == str2);
+    ASSERT_W(str1 != str3);
+    ASSERT_W(hash_bytes("abcd", 4) == hash_string("abcd"));
+    ASSERT_W(hash_map_find_string(&vm.strings, "xyz", 3, hash_bytes("xyz", 3)) == str3);
+    ASSERT_W(hash_map_find_string(&vm.strings, "xy", 2, hash_bytes("xy", 2)) == NULL);
+
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(churnTest) {
+    vm_t vm;
+    init_test_vm(&vm, 10*1024*1024);
+    hash_map_t hm;
+    init_hash_map(&hm, arena_allocator(&vm.arena));
+
+    const size_t SIZE = 1000;
+    obj_string_t* keys[SIZE];
+    bool present[SIZE];
+    char buffer[32];
+    for (size_t i = 0; i < SIZE; ++ i) {
+        int len = snprintf(buffer, sizeof(buffer), "key%zu", i);
+        keys[i] = intern_obj_string(len, buffer, hash_bytes(buffer, len), &vm);
+        present[i] = false;
+    }
+
+    // Keep about half of the keys in the map while inserting and deleting randomly.
+    size_t count = 0;
+    for (size_t round = 0; round < 100000; ++ round) {
+        size_t i = rand() % SIZE;
+        if (present[i]) {
+            ASSERT_W(hash_map_delete(&hm, keys[i]));
+            count -= 1;
+        } else {
+            ASSERT_W(hash_map_insert(&hm, keys[i], INTEGER_VAL(i)));
+            count += 1;
+        }
+        present[i] = !present[i];
+    }
+
+    ASSERT_W(hm.count == count);
+    ASSERT_W(hm.capacity <= 2048);
+    for (size_t i = 0; i < SIZE; ++ i) {
+        value_t val;
+        ASSERT_W(hash_map_fetch(&hm, keys[i], &val) == present[i]);
+        if (present[i]) {
+            ASSERT_W(AS_NUMBER(val) == (int)i);
+        }
+    }
+
+    free_hash_map(&hm);
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+TEST(clusterMissTest) {
+    vm_t vm;
+    init_test_vm(&vm, 10*1024*1024);
+    hash_map_t hm;
+    init_hash_map(&hm, arena_allocator(&vm.arena));
+
+    // Keys with chosen hashes, 10 with home 0 followed by a run of 30 with home 10,
+    // so the entries from index 10 on are closer to their home than a key from 0..9.
+    const size_t SIZE = 40;
+    obj_string_t* keys[SIZE];
+    char buffer[32];
+    for (size_t i = 0; i < SIZE; ++ i) {
+        int len = snprintf(buffer, sizeof(buffer), "cluster%zu", i);
+        keys[i] = build_obj_string(len, buffer, i < 10 ? 0 : 10, &vm);
+        ASSERT_W(hash_map_insert(&hm, keys[i], INTEGER_VAL(i)));
+    }
+    ASSERT_W(hm.capacity == 64);
+
+    // Missed lookups starting before and inside the long run, and with
+    // upper bits of the hash not used for indexing.
+    const uint32_t miss_hashes[] = {0, 5, 9, 10, 20, 39, 64 + 5};
+    for (size_t i = 0; i < sizeof(miss_hashes) / sizeof(*miss_hashes); ++ i) {
+        obj_string_t* missing = build_obj_string(7, "missing", miss_hashes[i], &vm);
+        value_t val;
+        ASSERT_W(!hash_map_fetch(&hm, missing, &val));
+        ASSERT_W(!hash_map_update(&hm, missing, NULL_VAL));
+        ASSERT_W(!hash_map_delete(&hm, missing));
+        ASSERT_W(hash_map_find_string(&hm, "missing", 7, miss_hashes[i]) == NULL);
+    }
+
+    // Removing from the first cluster shifts the run back, the keys are still found.
+    ASSERT_W(hash_map_delete(&hm, keys[3]));
+    for (size_t i = 0; i < SIZE; ++ i) {
+        value_t val;
+        ASSERT_W(hash_map_fetch(&hm, keys[i], &val) == (i != 3));
+        if (i != 3) {
+            ASSERT_W(AS_NUMBER(val) == (int)i);
+            ASSERT_W(hash_map_find_string(&hm, keys[i]->data, keys[i]->length, keys[i]->hash) == keys[i]);
+        }
+    }
+
+    free_hash_map(&hm);
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
+
+/// djb2, the previous string hash, kept as a baseline for the benchmark.
+static uint32_t djb2_bytes(const char* str, size_t length) {
+    uint32_t hash = 5381;
+    for (size_t i = 0; i < length; ++ i) {
+        hash = ((hash << 5) + hash) + str[i];
+    }
+    return hash;
+}
+
+/// Lookup of the previous map, linear probing with the index divided
+/// by capacity which is not power of two. Keys hold djb2 hashes.
+static entry_t* baseline_find_entry(entry_t* entries, size_t capacity, obj_string_t* key) {
+    size_t index = key->hash % capacity;
+    while (entries[index].key != key && entries[index].key != NULL) {
+        index = (index + 1) % capacity;
+    }
+    return &entries[index];
+}
 
+static double elapsed_ms(clock_t start) {
+    return (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+/// Prints lookup throughput of the previous and the current map, and checks
+/// that both maps return the same values.
+TEST(lookupBenchmark) {
+    vm_t vm;
+    init_test_vm(&vm, 64*1024*1024);
+    hash_map_t hm;
+    init_hash_map(&hm, arena_allocator(&vm.arena));
+
+    // Identifiers of the lengths usually seen in fml programs.
+    const size_t KEYS = 2000;
+    const size_t LOOKUPS = 10000000;
+    obj_string_t* keys[KEYS];
+    obj_string_t* baseline_keys[KEYS];
+    char buffer[32];
+    size_t baseline_capacity = 0;
+    while (KEYS >= baseline_capacity * HASH_MAP_LOAD_BALANCE) {
+        baseline_capacity = NEW_CAPACITY(baseline_capacity);
+    }
+    entry_t* baseline = calloc(baseline_capacity, sizeof(*baseline));
+    for (size_t i = 0; i < KEYS; ++ i) {
+        int len = snprintf(buffer, sizeof(buffer), "identifier_%zu", i * 7919);
+        keys[i] = intern_obj_string(len, buffer, hash_bytes(buffer, len), &vm);
+        hash_map_insert(&hm, keys[i], INTEGER_VAL(i));
+        baseline_keys[i] = build_obj_string(len, buffer, djb2_bytes(buffer, len), &vm);
+        entry_t* entry = baseline_find_entry(baseline, baseline_capacity, baseline_keys[i]);
+        entry->key = baseline_keys[i];
+        entry->value = INTEGER_VAL(i);
+    }
+
+    clock_t start = clock();
+    int64_t sum = 0;
+    for (size_t i = 0; i < LOOKUPS; ++ i) {
+        entry_t* entry = baseline_find_entry(baseline, baseline_capacity, baseline_keys[(i * 31) % KEYS]);
+        sum += AS_NUMBER(entry->value);
+    }
+    double baseline_ms = elapsed_ms(start);
+
+    start = clock();
+    bool found = true;
+    for (size_t i = 0; i < LOOKUPS; ++ i) {
+        value_t val;
+        found &= hash_map_fetch(&hm, keys[(i * 31) % KEYS], &val);
+        sum -= AS_NUMBER(val);
+    }
+    double lookup_ms = elapsed_ms(start);
+
+    // Both maps hold the same values, so the checksum is zero.
+    printf("%zu lookups: previous map %.1f ms (%.1f M/s), hash_map_t %.1f ms (%.1f M/s), checksum %ld\n",
+           LOOKUPS, baseline_ms, LOOKUPS / baseline_ms / 1000.0, lookup_ms, LOOKUPS / lookup_ms / 1000.0, (long)sum);
+    ASSERT_W(found);
+    ASSERT_W(sum == 0);
+
+    free(baseline);
+    free_hash_map(&hm);
+    free_vm(&vm);
+    return EXIT_SUCCESS;
+}
 
 int main(void) {
     RUN_TEST(basicTest);
     RUN_TEST(reallocationTest);
+    RUN_TEST(internTest);
+    RUN_TEST(churnTest);
+    RUN_TEST(clusterMissTest);
+    RUN_TEST(lookupBenchmark);
+    free(heap_pool);
 }
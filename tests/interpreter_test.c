@@ -25,6 +25,7 @@ TEST(DataStructureTest) {
     write_chunk(&vm.bytecode, 0);
     write_chunk(&vm.bytecode, 0);
 
+    reserve_stack(&vm.op_stack, 16);
     push(&vm, vm.bytecode.pool.data[0]);
     push(&vm, vm.bytecode.pool.data[1]);
     push(&vm, vm.bytecode.pool.data[0]);
@@ -34,7 +35,6 @@ TEST(DataStructureTest) {
     push(&vm, vm.bytecode.pool.data[0]);
     push(&vm, vm.bytecode.pool.data[1]);
     push(&vm, vm.bytecode.pool.data[0]);
-    // Force reallocation
     value_t x1 = pop(&vm.op_stack);
     value_t x2 = pop(&vm.op_stack);
     ASSERT_W(IS_NUMBER(x1));
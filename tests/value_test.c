@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "include/constant.h"
+#include "asserts.h"
+
+// Built once with the default values and once with __COMPACT_VALUES__,
+// the macros have to round-trip the same way in both representations.
+
+TEST(integerTest) {
+    const int32_t numbers[] = {0, 1, -1, 42, -42, INT32_MAX, INT32_MIN};
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(*numbers); ++i) {
+        value_t value = INTEGER_VAL(numbers[i]);
+        ASSERT_W(IS_NUMBER(value));
+        ASSERT_W(!IS_BOOL(value) && !IS_NULL(value) && !IS_OBJ(value));
+        ASSERT_W(AS_NUMBER(value) == numbers[i]);
+    }
+    return EXIT_SUCCESS;
+}
+
+TEST(boolTest) {
+    value_t t = BOOL_VAL(true);
+    value_t f = BOOL_VAL(false);
+    ASSERT_W(IS_BOOL(t) && IS_BOOL(f));
+    ASSERT_W(!IS_NUMBER(t) && !IS_NULL(t) && !IS_OBJ(t));
+    ASSERT_W(AS_BOOL(t) == true);
+    ASSERT_W(AS_BOOL(f) == false);
+    // Any non-zero value is true
+    ASSERT_W(AS_BOOL(BOOL_VAL(2)) == true);
+    return EXIT_SUCCESS;
+}
+
+TEST(nullTest) {
+    value_t value = NULL_VAL;
+    ASSERT_W(IS_NULL(value));
+    ASSERT_W(!IS_NUMBER(value) && !IS_BOOL(value) && !IS_OBJ(value));
+    return EXIT_SUCCESS;
+}
+
+TEST(pointerTest) {
+    static obj_t static_obj = {.type = OBJ_ARRAY};
+    obj_t* heap_obj = malloc(sizeof(obj_t));
+    heap_obj->type = OBJ_STRING;
+    obj_t* objects[] = {&static_obj, heap_obj};
+    for (size_t i = 0; i < sizeof(objects) / sizeof(*objects); ++i) {
+        value_t value = OBJ_VAL(objects[i]);
+        ASSERT_W(IS_OBJ(value));
+        ASSERT_W(!IS_NUMBER(value) && !IS_BOOL(value) && !IS_NULL(value));
+        ASSERT_W(AS_OBJ(value) == objects[i]);
+        ASSERT_W(OBJ_TYPE(value) == objects[i]->type);
+    }
+    ASSERT_W(IS_ARRAY(OBJ_VAL(&static_obj)));
+    ASSERT_W(IS_STRING(OBJ_VAL(heap_obj)));
+    free(heap_obj);
+    return EXIT_SUCCESS;
+}
+
+int main(void) {
+    RUN_TEST(integerTest);
+    RUN_TEST(boolTest);
+    RUN_TEST(nullTest);
+    RUN_TEST(pointerTest);
+}